@@ -0,0 +1,484 @@
+/*
+ * lunix-bench.c
+ *
+ * Userspace replay harness for the Lunix:TNG protocol code.
+ *
+ * Builds lunix-protocol.c and lunix-sensors.c against the thin
+ * kernel shims under shim/ and feeds them an XMesh byte stream
+ * in chunks of configurable size, the way lunix_ldisc_receive()
+ * would receive it from the TTY layer. Reports parser throughput
+ * in MB/s, packets/s and ns/packet.
+ *
+ * The byte stream is either a raw capture of a gateway TTY
+ * (e.g. recorded with "socat -u TCP:<endpoint> - >capture.bin",
+ * see lunix-tcp.sh) or a synthetic stream of well-formed,
+ * byte-stuffed sensor packets.
+ *
+ */
+
+#include <time.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "lunix.h"
+#include "lunix-protocol.h"
+#include "lunix-events.h"
+#include "lunix-scan.h"
+
+/*
+ * Global state normally owned by lunix-module.c
+ */
+int lunix_sensor_cnt = LUNIX_SENSOR_CNT;
+
+int lunix_shim_verbose = 0;
+
+#define DEFAULT_CHUNKS		"1,16,64,256,4096"
+#define DEFAULT_REPEAT		10
+#define DEFAULT_PACKETS		100000
+#define MAX_CHUNKS		32
+#define MAX_GATEWAYS		64
+#define MAX_READERS		64
+
+/*
+ * Synthetic packets carry a TOS_Msg sized payload by default,
+ * at least enough to hold the light measurement.
+ */
+#define DEFAULT_PAYLOAD_LEN	29
+#define MIN_PAYLOAD_LEN		(LIGHT_OFFSET + 2 - 7)
+#define MAX_PAYLOAD_LEN		255
+
+struct stream {
+	unsigned char *data;
+	size_t len;
+	size_t size;
+};
+
+static void stream_put(struct stream *st, unsigned char c)
+{
+	if (st->len == st->size) {
+		st->size = st->size ? 2 * st->size : 4096;
+		st->data = realloc(st->data, st->size);
+		if (!st->data) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	st->data[st->len++] = c;
+}
+
+/*
+ * Append a byte to the stream, escaping it
+ * if it collides with the framing characters.
+ */
+static void stream_put_stuffed(struct stream *st, unsigned char c)
+{
+	if (c == 0x7E || c == 0x7D) {
+		stream_put(st, 0x7D);
+		stream_put(st, c ^ 0x20);
+	} else
+		stream_put(st, c);
+}
+
+/*
+ * CRC-CCITT (poly 0x1021, initial value 0), as computed by the
+ * gateway over everything between the start byte and the CRC.
+ */
+static uint16_t xmesh_crc_byte(uint16_t crc, unsigned char c)
+{
+	int i;
+
+	crc ^= c << 8;
+	for (i = 0; i < 8; i++)
+		crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+	return crc;
+}
+
+static void put_le16(unsigned char *p, uint16_t v)
+{
+	p[0] = v & 0xFF;
+	p[1] = v >> 8;
+}
+
+/*
+ * Generate a stream of sensor packets for nodes 1 to nsensors,
+ * with random measurements. If corrupt is not zero, one in every
+ * corrupt packets has a random bit flipped on the wire, which may
+ * hit the payload, the CRC or the framing itself.
+ */
+static void stream_synth(struct stream *st, long npackets, int nsensors,
+	int payload_len, int corrupt)
+{
+	unsigned char pkt[7 + MAX_PAYLOAD_LEN];
+	uint16_t crc;
+	size_t start;
+	long n;
+	int i;
+
+	for (n = 0; n < npackets; n++) {
+		pkt[0] = 0x7E;			/* Start byte */
+		pkt[1] = 0x42;			/* Packet type, no ACK */
+		put_le16(&pkt[2], 0x007E);	/* Destination: UART */
+		pkt[PACKET_SIGNATURE_OFFSET] = 0x0B;
+		pkt[5] = 0x7D;			/* AM group */
+		pkt[6] = payload_len;
+		for (i = 7; i < 7 + payload_len; i++)
+			pkt[i] = rand();
+		put_le16(&pkt[NODE_OFFSET], 1 + n % nsensors);
+		put_le16(&pkt[VREF_OFFSET], 300 + rand() % 300);
+		put_le16(&pkt[TEMPERATURE_OFFSET], 400 + rand() % 200);
+		put_le16(&pkt[LIGHT_OFFSET], rand() % 1024);
+
+		crc = 0;
+		for (i = 1; i < 7 + payload_len; i++)
+			crc = xmesh_crc_byte(crc, pkt[i]);
+
+		start = st->len;
+		stream_put(st, pkt[0]);
+		for (i = 1; i < 7 + payload_len; i++)
+			stream_put_stuffed(st, pkt[i]);
+		stream_put_stuffed(st, crc & 0xFF);
+		stream_put_stuffed(st, crc >> 8);
+		stream_put(st, 0x7E);		/* End byte */
+
+		if (corrupt && n % corrupt == 0)
+			st->data[start + rand() % (st->len - start)] ^= 1 << (rand() % 8);
+	}
+}
+
+static void stream_load(struct stream *st, const char *fname)
+{
+	FILE *f;
+	int c;
+
+	if (!(f = fopen(fname, "rb"))) {
+		perror(fname);
+		exit(1);
+	}
+	while ((c = getc(f)) != EOF)
+		stream_put(st, c);
+	fclose(f);
+}
+
+static void stream_save(struct stream *st, const char *fname)
+{
+	FILE *f;
+
+	if (!(f = fopen(fname, "wb")) ||
+	    fwrite(st->data, 1, st->len, f) != st->len || fclose(f)) {
+		perror(fname);
+		exit(1);
+	}
+}
+
+static unsigned long sensors_wakeups(void)
+{
+	struct lunix_sensor_struct *s;
+	unsigned long w = 0;
+	int i;
+
+	for (i = 0; i < lunix_sensor_cnt; i++)
+		if ((s = lunix_sensor_lookup(i)))
+			w += s->wq.wakeups;
+	return w;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * A gateway TTY with its own protocol state,
+ * replaying the whole stream repeat times, chunk bytes at a time
+ */
+struct gateway {
+	pthread_t thread;
+	struct stream *st;
+	int chunk;
+	int repeat;
+	struct lunix_protocol_state_struct state;
+};
+
+static void *replay(void *arg)
+{
+	struct gateway *gw = arg;
+	struct stream *st = gw->st;
+	size_t off, n;
+	int r;
+
+	lunix_protocol_init(&gw->state);
+	for (r = 0; r < gw->repeat; r++)
+		for (off = 0; off < st->len; off += n) {
+			n = st->len - off < gw->chunk ? st->len - off : gw->chunk;
+			lunix_protocol_received_buf(&gw->state, st->data + off, n);
+		}
+	return NULL;
+}
+
+/*
+ * A process polling every measurement of every sensor through the
+ * lockless reader protocol for as long as the gateways are running,
+ * the way lunix_chrdev_state_update() or a process mapping the
+ * measurement pages would. A snapshot whose newest sample does not
+ * carry the sequence number the header promised is torn, which the
+ * protocol must never let through.
+ */
+struct reader {
+	pthread_t thread;
+	unsigned long snapshots;
+	unsigned long retries;
+	unsigned long torn;
+};
+
+static volatile int readers_stop;
+
+static void *poll_sensors(void *arg)
+{
+	struct reader *rd = arg;
+	struct lunix_sensor_struct *s;
+	struct lunix_msr_data_struct *msr;
+	struct lunix_msr_sample_struct sample;
+	uint32_t start;
+	uint64_t seq;
+	int i, j;
+
+	rd->snapshots = rd->retries = rd->torn = 0;
+	while (!readers_stop)
+		for (i = 0; i < lunix_sensor_cnt; i++) {
+			if (!(s = lunix_sensor_lookup(i)))
+				continue;
+			for (j = 0; j < N_LUNIX_MSR; j++) {
+				msr = s->msr_data[j];
+				for (;;) {
+					start = lunix_msr_read_begin(msr);
+					seq = msr->seq;
+					sample = *lunix_msr_sample(msr, seq);
+					if (!lunix_msr_read_retry(msr, start))
+						break;
+					rd->retries++;
+				}
+				if (seq && sample.seq != seq)
+					rd->torn++;
+				rd->snapshots++;
+			}
+		}
+	return NULL;
+}
+
+/*
+ * A consumer of the event stream, the way a process reading
+ * /dev/lunix-events would, draining its ring as fast as it can
+ */
+struct consumer {
+	pthread_t thread;
+	struct lunix_events_reader_struct *r;
+	unsigned long events;
+};
+
+static void *drain_events(void *arg)
+{
+	struct consumer *c = arg;
+	struct lunix_event_struct ev[64];
+	int n, stop;
+
+	c->events = 0;
+	do {
+		stop = readers_stop;
+		n = lunix_events_fetch(c->r, ev, ARRAY_SIZE(ev));
+		c->events += n;
+	} while (n || !stop);
+	return NULL;
+}
+
+static int events_consumer;
+
+static void bench_chunk(struct stream *st, int chunk, int repeat, int ngateways,
+	int nreaders)
+{
+	struct consumer c;
+	static struct gateway gws[MAX_GATEWAYS];
+	static struct reader rds[MAX_READERS];
+	unsigned long bytes, packets, dropped, resyncs, wakeups;
+	unsigned long snapshots, retries, torn;
+	double t;
+	int i;
+
+	wakeups = sensors_wakeups();
+
+	readers_stop = 0;
+	for (i = 0; i < nreaders; i++)
+		if (pthread_create(&rds[i].thread, NULL, poll_sensors, &rds[i])) {
+			perror("pthread_create");
+			exit(1);
+		}
+	if (events_consumer) {
+		if (!(c.r = lunix_events_open()) ||
+		    pthread_create(&c.thread, NULL, drain_events, &c)) {
+			fprintf(stderr, "failed to start the event consumer\n");
+			exit(1);
+		}
+	}
+
+	t = now();
+	for (i = 0; i < ngateways; i++) {
+		gws[i].st = st;
+		gws[i].chunk = chunk;
+		gws[i].repeat = repeat;
+		if (pthread_create(&gws[i].thread, NULL, replay, &gws[i])) {
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+	for (i = 0; i < ngateways; i++)
+		pthread_join(gws[i].thread, NULL);
+	t = now() - t;
+
+	readers_stop = 1;
+	snapshots = retries = torn = 0;
+	for (i = 0; i < nreaders; i++) {
+		pthread_join(rds[i].thread, NULL);
+		snapshots += rds[i].snapshots;
+		retries += rds[i].retries;
+		torn += rds[i].torn;
+	}
+	if (events_consumer)
+		pthread_join(c.thread, NULL);
+
+	packets = dropped = resyncs = 0;
+	for (i = 0; i < ngateways; i++) {
+		packets += gws[i].state.rx_packets;
+		dropped += gws[i].state.rx_crc_errors;
+		resyncs += gws[i].state.rx_resyncs;
+	}
+	bytes = (unsigned long)st->len * repeat * ngateways;
+	wakeups = sensors_wakeups() - wakeups;
+
+	printf("%8d %12lu %10lu %10lu %10lu %10lu %10.2f %12.0f %10.1f\n",
+		chunk, bytes, packets, dropped, resyncs, wakeups,
+		bytes / t / 1e6,
+		packets / t,
+		packets ? t * 1e9 / packets : 0.0);
+	if (nreaders)
+		printf("%8s %lu snapshots read, %lu retries, %lu torn\n",
+			"", snapshots, retries, torn);
+	if (events_consumer) {
+		printf("%8s %lu events streamed, %u lost to overruns\n",
+			"", c.events, c.r->overruns);
+		lunix_events_close(c.r);
+	}
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr,
+		"Usage: %s [-c chunk,...] [-n repeat] [-p packets] [-l payload]\n"
+		"       %*s [-e every] [-s sensors] [-g gateways] [-r readers]\n"
+		"       %*s [-E] [-w outfile] [-v]\n"
+		"       %*s [capture]\n\n"
+		"Replay an XMesh byte stream through the Lunix:TNG protocol code.\n"
+		"Without a capture file, a synthetic stream is generated.\n\n"
+		"  -c  chunk sizes to feed the parser with [" DEFAULT_CHUNKS "]\n"
+		"  -n  times to replay the stream for every chunk size [%d]\n"
+		"  -p  packets in the synthetic stream [%d]\n"
+		"  -l  payload length of synthetic packets, %d-%d [%d]\n"
+		"  -e  corrupt one in every so many synthetic packets [never]\n"
+		"  -s  number of sensors [%d]\n"
+		"  -g  gateways replaying the stream in parallel, each\n"
+		"      with its own protocol state, up to %d [1]\n"
+		"  -r  readers polling the sensors meanwhile, up to %d [0]\n"
+		"  -E  consume the event stream meanwhile\n"
+		"  -w  write the stream to outfile and exit\n"
+		"  -v  show kernel messages\n",
+		argv0, (int)strlen(argv0), "", (int)strlen(argv0), "",
+		(int)strlen(argv0), "",
+		DEFAULT_REPEAT, DEFAULT_PACKETS,
+		MIN_PAYLOAD_LEN, MAX_PAYLOAD_LEN, DEFAULT_PAYLOAD_LEN,
+		LUNIX_SENSOR_CNT, MAX_GATEWAYS, MAX_READERS);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	char chunks_str[] = DEFAULT_CHUNKS;
+	char *chunk_list = chunks_str, *tok;
+	int chunks[MAX_CHUNKS], nchunks;
+	long npackets = DEFAULT_PACKETS;
+	int payload_len = DEFAULT_PAYLOAD_LEN;
+	int corrupt = 0;
+	int ngateways = 1;
+	int nreaders = 0;
+	int repeat = DEFAULT_REPEAT;
+	const char *outfile = NULL;
+	struct stream st = { NULL, 0, 0 };
+	int i, opt;
+
+	while ((opt = getopt(argc, argv, "c:n:p:l:e:s:g:r:Ew:v")) != -1) {
+		switch (opt) {
+		case 'c': chunk_list = optarg; break;
+		case 'n': repeat = atoi(optarg); break;
+		case 'p': npackets = atol(optarg); break;
+		case 'l': payload_len = atoi(optarg); break;
+		case 'e': corrupt = atoi(optarg); break;
+		case 's': lunix_sensor_cnt = atoi(optarg); break;
+		case 'g': ngateways = atoi(optarg); break;
+		case 'r': nreaders = atoi(optarg); break;
+		case 'E': events_consumer = 1; break;
+		case 'w': outfile = optarg; break;
+		case 'v': lunix_shim_verbose = 1; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (optind < argc - 1 || repeat <= 0 || npackets <= 0 || corrupt < 0 ||
+	    payload_len < MIN_PAYLOAD_LEN || payload_len > MAX_PAYLOAD_LEN ||
+	    ngateways <= 0 || ngateways > MAX_GATEWAYS ||
+	    nreaders < 0 || nreaders > MAX_READERS ||
+	    lunix_sensor_cnt <= 0 || lunix_sensor_cnt > LUNIX_SENSOR_MAX)
+		usage(argv[0]);
+
+	nchunks = 0;
+	for (tok = strtok(chunk_list, ","); tok; tok = strtok(NULL, ",")) {
+		if (nchunks == MAX_CHUNKS || (chunks[nchunks++] = atoi(tok)) <= 0)
+			usage(argv[0]);
+	}
+
+	if (optind < argc)
+		stream_load(&st, argv[optind]);
+	else
+		stream_synth(&st, npackets, lunix_sensor_cnt, payload_len, corrupt);
+
+	if (outfile) {
+		stream_save(&st, outfile);
+		return 0;
+	}
+
+	lunix_protocol_crc_init();
+	if (lunix_all_init() < 0) {
+		fprintf(stderr, "lunix_all_init failed\n");
+		return 1;
+	}
+
+	printf("%lu bytes, %d sensors, %d gateways, %d readers, %d passes per chunk size, "
+		"%s scanner\n\n", (unsigned long)st.len, lunix_sensor_cnt, ngateways,
+		nreaders, repeat, LUNIX_SCAN_IMPL);
+	printf("%8s %12s %10s %10s %10s %10s %10s %12s %10s\n",
+		"chunk", "bytes", "packets", "dropped", "resyncs", "wakeups", "MB/s", "packets/s", "ns/packet");
+
+	/* Warm up caches and sensor pages */
+	bench_chunk(&st, 4096, 1, 1, 0);
+	printf("\n");
+
+	for (i = 0; i < nchunks; i++)
+		bench_chunk(&st, chunks[i], repeat, ngateways, nreaders);
+
+	lunix_sensors_destroy();
+	lunix_all_destroy();
+	free(st.data);
+
+	return 0;
+}
@@ -0,0 +1,119 @@
+/*
+ * lunix-calib.c
+ *
+ * Conversion of raw measurements to thousandths of a unit,
+ * with per-node calibration, for Lunix:TNG
+ *
+ */
+
+#include <linux/slab.h>
+#include <linux/types.h>
+#include <linux/atomic.h>
+#include <linux/kernel.h>
+#include <linux/rcupdate.h>
+
+#include "lunix.h"
+#include "lunix-calib.h"
+#include "lunix-lookup.h"
+
+/*
+ * Replaces the tables of a node, t may be NULL for the defaults.
+ * Conversions in progress finish with the old tables, which are
+ * freed once they are all done. Concurrent updaters need no lock:
+ * xchg() orders the filling of t before its publication, and hands
+ * each of them a different old table to free. The sensor lock is
+ * left to the line disciplines.
+ */
+static void lunix_calib_swap(struct lunix_sensor_struct *s, struct lunix_calib_table_struct *t)
+{
+	struct lunix_calib_table_struct *old;
+
+	old = xchg(&s->calib, t);
+
+	if (old)
+		kfree_rcu(old, rcu);
+}
+
+/*
+ * Calibrates sensor s, building its conversion tables
+ * from the parameters given. Runs in process context.
+ */
+int lunix_calib_set(struct lunix_sensor_struct *s, const struct lunix_calib_struct *params)
+{
+	struct lunix_calib_table_struct *t;
+
+	if (!lunix_calib_valid(params))
+		return -EINVAL;
+
+	/*
+	 * The defaults are the default tables, so that userspace
+	 * converting with those gets exactly what we report
+	 */
+	if (lunix_calib_is_default(params)) {
+		lunix_calib_reset(s);
+		return 0;
+	}
+
+	t = kmalloc(sizeof(*t), GFP_KERNEL);
+	if (!t)
+		return -ENOMEM;
+
+	t->params = *params;
+	t->batt_num = lunix_calib_build(params, t->temp, t->batt);
+
+	lunix_calib_swap(s, t);
+	debug("sensor %u calibrated, %d m°C at raw value 512\n", s->id, t->temp[512]);
+	return 0;
+}
+
+/*
+ * Back to the default tables
+ */
+void lunix_calib_reset(struct lunix_sensor_struct *s)
+{
+	lunix_calib_swap(s, NULL);
+}
+
+void lunix_calib_get(struct lunix_sensor_struct *s, struct lunix_calib_struct *params)
+{
+	struct lunix_calib_table_struct *t;
+
+	rcu_read_lock();
+	t = rcu_dereference(s->calib);
+	if (t)
+		*params = t->params;
+	rcu_read_unlock();
+	if (t)
+		return;
+
+	params->sh_a = LUNIX_CALIB_SH_A;
+	params->sh_b = LUNIX_CALIB_SH_B;
+	params->sh_c = LUNIX_CALIB_SH_C;
+	params->r1 = LUNIX_CALIB_R1;
+	params->batt_ref = LUNIX_CALIB_BATT_REF;
+}
+
+/*
+ * Converts a raw 16-bit measurement of sensor s [NULL: not yet
+ * allocated, thus not calibrated] to thousandths of a unit
+ */
+long lunix_calib_convert(struct lunix_sensor_struct *s, enum lunix_msr_enum type, uint16_t raw)
+{
+	struct lunix_calib_table_struct *t;
+	long ret;
+
+	if (type == LIGHT)
+		return lunix_lookup_light(raw);
+
+	rcu_read_lock();
+	t = s ? rcu_dereference(s->calib) : NULL;
+	if (!t)
+		ret = type == BATT ? lunix_lookup_batt(raw) : lunix_lookup_temp(raw);
+	else if (type == BATT)
+		ret = raw < LUNIX_CALIB_TABLE_SIZE ? t->batt[raw] : t->batt_num / raw;
+	else
+		ret = t->temp[raw < LUNIX_CALIB_TABLE_SIZE ? raw : LUNIX_CALIB_TABLE_SIZE - 1];
+	rcu_read_unlock();
+
+	return ret;
+}
@@ -0,0 +1,175 @@
+/*
+ * lunix-calib.h
+ *
+ * Definition file for per-node calibration
+ * of Lunix:TNG sensor measurements
+ *
+ */
+
+#ifndef _LUNIX_CALIB_H
+#define _LUNIX_CALIB_H
+
+#ifdef __KERNEL__
+#include <linux/kernel.h>
+#include <linux/bitops.h>
+#include <linux/math64.h>
+#define lunix_calib_fls64(x)		fls64(x)
+#define lunix_calib_div_s64(a, b)	div64_s64(a, b)
+#define lunix_calib_div_u64(a, b)	div_u64(a, b)
+#else
+#include <limits.h>
+#include <stdint.h>
+#define lunix_calib_fls64(x)		(64 - __builtin_clzll(x))	/* x != 0 */
+#define lunix_calib_div_s64(a, b)	((a) / (b))
+#define lunix_calib_div_u64(a, b)	((a) / (b))
+#endif
+
+#include "lunix.h"
+#include "lunix-chrdev.h"
+
+/* Entries in a conversion table, the range of the 10-bit ADC */
+#define LUNIX_CALIB_TABLE_SIZE	1024
+
+/* Light is not calibrated: raw * LUNIX_CALIB_LIGHT_FS / 65535 */
+#define LUNIX_CALIB_LIGHT_FS	5000000U
+
+/*
+ * Fixed-point arithmetic for building the tables of a calibrated node,
+ * shared with userspace [see lunix-user.h] so both build the same ones.
+ * There is no floating point in kernelspace: logarithms are in Q24, and
+ * the Steinhart-Hart terms in units of 10^-12 like the coefficients.
+ */
+#define LUNIX_CALIB_Q		24
+#define LUNIX_CALIB_LN2_Q32	2977044472ULL	/* ln(2) * 2^32 */
+
+/* Limits that keep every intermediate result within 64 bits */
+#define LUNIX_CALIB_COEFF_MAX	10000000000LL	/* 0.01 */
+#define LUNIX_CALIB_BATT_MAX	10000000U	/* 10 V */
+
+/*
+ * Natural logarithm of x >= 1 in Q24: the integer part of log2(x) is
+ * the position of its top bit, the fraction comes one bit at a time
+ * from squaring the mantissa.
+ */
+static inline int64_t lunix_calib_ln(uint64_t x)
+{
+	int i, msb = lunix_calib_fls64(x) - 1;
+	uint32_t frac = 0;
+	uint64_t m;
+
+	/* Mantissa in [1, 2), in Q30 */
+	m = msb > 30 ? x >> (msb - 30) : x << (30 - msb);
+	for (i = LUNIX_CALIB_Q - 1; i >= 0; i--) {
+		m = (m * m) >> 30;
+		if (m >= 2ULL << 30) {
+			m >>= 1;
+			frac |= 1U << i;
+		}
+	}
+
+	return (int64_t)((((uint64_t)msb << LUNIX_CALIB_Q | frac) * LUNIX_CALIB_LN2_Q32) >> 32);
+}
+
+/*
+ * Temperature in thousandths of a degree Celsius for raw value raw.
+ * Follows uint16_to_temp() in mk_lookup_tables.c, down to its
+ * -272.15 offset, so that calibrated and default nodes agree.
+ */
+static inline int32_t lunix_calib_temp(const struct lunix_calib_struct *p, unsigned int raw)
+{
+	int64_t l, l2, l3, kinv, t;
+
+	/* Open or shorted thermistor */
+	if (raw == 0 || raw >= 1023)
+		return -272150;
+
+	/* ln(Rth), Rth = r1 * (1023 - raw) / raw, r1 in mOhm */
+	l = lunix_calib_ln((uint64_t)p->r1 * (1023 - raw)) -
+		lunix_calib_ln(raw) - lunix_calib_ln(1000);
+	l2 = (l * l) >> LUNIX_CALIB_Q;
+	l3 = (l2 * l) >> LUNIX_CALIB_Q;
+
+	kinv = p->sh_a + ((p->sh_b * l) >> LUNIX_CALIB_Q) +
+		((p->sh_c * (l3 >> 12)) >> (LUNIX_CALIB_Q - 12));
+	if (kinv <= 0)
+		return -272150;
+
+	/* 1 / kinv in mK, kinv being in units of 10^-12 / K */
+	t = lunix_calib_div_s64(1000000000000000LL, kinv) - 272150;
+	if (t < -272150)
+		t = -272150;
+	if (t > INT_MAX)
+		t = INT_MAX;
+	return t;
+}
+
+static inline int lunix_calib_coeff_valid(int64_t c)
+{
+	return c >= -LUNIX_CALIB_COEFF_MAX && c <= LUNIX_CALIB_COEFF_MAX;
+}
+
+static inline int lunix_calib_valid(const struct lunix_calib_struct *p)
+{
+	return p->r1 != 0 && p->batt_ref != 0 &&
+		p->batt_ref <= LUNIX_CALIB_BATT_MAX &&
+		lunix_calib_coeff_valid(p->sh_a) &&
+		lunix_calib_coeff_valid(p->sh_b) &&
+		lunix_calib_coeff_valid(p->sh_c);
+}
+
+static inline int lunix_calib_is_default(const struct lunix_calib_struct *p)
+{
+	return p->sh_a == LUNIX_CALIB_SH_A && p->sh_b == LUNIX_CALIB_SH_B &&
+		p->sh_c == LUNIX_CALIB_SH_C && p->r1 == LUNIX_CALIB_R1 &&
+		p->batt_ref == LUNIX_CALIB_BATT_REF;
+}
+
+/*
+ * Fills in the tables for parameters p, returns the numerator
+ * of the battery conversion past full scale [num / raw].
+ */
+static inline uint32_t lunix_calib_build(const struct lunix_calib_struct *p,
+	int32_t *temp, int32_t *batt)
+{
+	uint32_t batt_num;
+	unsigned int i;
+
+	batt_num = lunix_calib_div_u64((uint64_t)p->batt_ref * 1023, 1000);
+	batt[0] = 0;
+	temp[0] = lunix_calib_temp(p, 0);
+	for (i = 1; i < LUNIX_CALIB_TABLE_SIZE; i++) {
+		batt[i] = batt_num / i;
+		temp[i] = lunix_calib_temp(p, i);
+	}
+	return batt_num;
+}
+
+#ifdef __KERNEL__
+
+#include <linux/rcupdate.h>
+
+/*
+ * The conversion tables of a calibrated node, built in full whenever
+ * its calibration changes and then swapped in, so conversions never
+ * see a half-built table and never do anything but a lookup.
+ * Protected by RCU, see lunix_calib_convert().
+ */
+struct lunix_calib_table_struct {
+	struct rcu_head rcu;
+	struct lunix_calib_struct params;
+	uint32_t batt_num;		/* batt_ref * 1023 in mV, for raw values past full scale */
+	int32_t temp[LUNIX_CALIB_TABLE_SIZE];
+	int32_t batt[LUNIX_CALIB_TABLE_SIZE];
+};
+
+/*
+ * Function prototypes
+ */
+int lunix_calib_set(struct lunix_sensor_struct *s, const struct lunix_calib_struct *params);
+void lunix_calib_reset(struct lunix_sensor_struct *s);
+void lunix_calib_get(struct lunix_sensor_struct *s, struct lunix_calib_struct *params);
+long lunix_calib_convert(struct lunix_sensor_struct *s, enum lunix_msr_enum type, uint16_t raw);
+
+#endif	/* __KERNEL__ */
+
+#endif	/* _LUNIX_CALIB_H */
@@ -14,11 +14,14 @@
 #include <linux/init.h>
 #include <linux/list.h>
 #include <linux/cdev.h>
+#include <linux/compat.h>
 #include <linux/poll.h>
 #include <linux/slab.h>
+#include <linux/ktime.h>
 #include <linux/sched.h>
 #include <linux/ioctl.h>
 #include <linux/types.h>
+#include <linux/bitops.h>
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/mmzone.h>
@@ -26,18 +29,87 @@
 #include <linux/spinlock.h>
 #include <linux/fcntl.h>
 
-#include <string.h>
+#include <asm/io.h>
+#include <asm/uaccess.h>
 #include <asm/byteorder.h>
 
 #include "lunix.h"
 #include "lunix-chrdev.h"
-#include "lunix-lookup.h"
+#include "lunix-calib.h"
+#include "lunix-ldisc.h"
+#include "lunix-events.h"
+#include "lunix-format.h"
 
 /*
  * Global data
  */
 
 struct cdev lunix_chrdev_cdev;
+struct cdev lunix_all_cdev;
+struct cdev lunix_events_cdev;
+
+static int lunix_chrdev_filtered(struct lunix_chrdev_state_struct *state)
+{
+	return ACCESS_ONCE(state->filter.deadband) || ACCESS_ONCE(state->filter.interval);
+}
+
+/*
+ * Whether a new sample should be reported under the filter, given
+ * the last one reported. Runs from the line discipline too, through
+ * lunix_chrdev_watch_fire(), so the filter and the reference are
+ * copied together under ref_lock.
+ *
+ * A change that is only held back by the interval arms the timer for
+ * when the interval ends, so that it gets reported then even if the
+ * sensor goes quiet.
+ */
+static int lunix_chrdev_filter_fires(struct lunix_chrdev_state_struct *state,
+	const struct lunix_msr_sample_struct *sample)
+{
+	struct lunix_filter_struct filter;
+	uint32_t deadband, interval;
+	uint64_t ref_timestamp, due;
+	int32_t ref_value;
+	unsigned long flags;
+	int64_t delta;
+	int ref_valid;
+
+	spin_lock_irqsave(&state->ref_lock, flags);
+	filter = state->filter;
+	ref_valid = state->ref_valid;
+	ref_value = state->ref_value;
+	ref_timestamp = state->ref_timestamp;
+	spin_unlock_irqrestore(&state->ref_lock, flags);
+
+	if (!ref_valid)
+		return 1;
+
+	deadband = filter.deadband;
+	interval = filter.interval;
+	if (deadband) {
+		delta = (int64_t)lunix_calib_convert(state->sensor, state->type,
+			sample->value) - ref_value;
+		if (delta < deadband && delta > -(int64_t)deadband)
+			return 0;
+	}
+	if (interval) {
+		due = ref_timestamp + (uint64_t)interval * NSEC_PER_MSEC;
+		if ((uint64_t)ktime_to_ns(ktime_get()) < due) {
+			hrtimer_start(&state->timer, ns_to_ktime(due), HRTIMER_MODE_ABS);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static enum hrtimer_restart lunix_chrdev_timer(struct hrtimer *timer)
+{
+	struct lunix_chrdev_state_struct *state =
+		container_of(timer, struct lunix_chrdev_state_struct, timer);
+
+	wake_up_interruptible(&state->watch.wq);
+	return HRTIMER_NORESTART;
+}
 
 /*
  * Just a quick [unlocked] check to see if the cached
@@ -45,100 +117,245 @@ struct cdev lunix_chrdev_cdev;
  */
 static int lunix_chrdev_state_needs_refresh(struct lunix_chrdev_state_struct *state)
 {
-    uint32_t state_time, msr_time;
 	struct lunix_sensor_struct *sensor;
-    
-    debug("going into lunix_chrdev_state_needs_refresh\n");
+	struct lunix_msr_data_struct *msr;
+	struct lunix_msr_sample_struct sample;
+	uint32_t start;
 	
 	WARN_ON ( !(sensor = state->sensor));
-	/* ? */
-    
-    state_time = state->buf_timestamp;
-    msr_time = (sensor->msr_data[state->type])->last_update;
-    
-    if (msr_time>state_time) {
-        debug("leaving with ret: 1 \n");
-        return 1;
-    }
-    
-	/* The following return is bogus, just for the stub to compile */
-    debug("leaving with ret: 0 \n");
-	return 0; /* ? */
+
+	msr = sensor->msr_data[state->type];
+	if (ACCESS_ONCE(msr->seq) == state->buf_seq)
+		return 0;
+	if (!lunix_chrdev_filtered(state))
+		return 1;
+
+	do {
+		start = lunix_msr_read_begin(msr);
+		sample = *lunix_msr_sample(msr, msr->seq);
+	} while (lunix_msr_read_retry(msr, start));
+
+	return lunix_chrdev_filter_fires(state, &sample);
+}
+
+/*
+ * Called on every update of the sensor of a watching file,
+ * from lunix_sensor_wake_up(): wakes up its readers only if
+ * there is something they would report.
+ */
+static int lunix_chrdev_watch_fire(struct lunix_sensor_watch_struct *w,
+	struct lunix_sensor_struct *s)
+{
+	return lunix_chrdev_state_needs_refresh(
+		container_of(w, struct lunix_chrdev_state_struct, watch));
+}
+
+static wait_queue_head_t *lunix_chrdev_wq(struct lunix_chrdev_state_struct *state)
+{
+	return ACCESS_ONCE(state->watched) ? &state->watch.wq : &state->sensor->wq;
+}
+
+/*
+ * Formats a converted measurement as a line of text in buf,
+ * returns the number of characters written.
+ */
+static int lunix_chrdev_format(enum lunix_msr_enum type, long value, unsigned char *buf)
+{
+	switch (type) {
+	case BATT:
+		return lunix_format_fixed(buf, value, LUNIX_CHRDEV_DECIMALS_BATT);
+	case TEMP:
+		return lunix_format_fixed(buf, value, LUNIX_CHRDEV_DECIMALS_TEMP);
+	default:
+		return lunix_format_fixed(buf, value, LUNIX_CHRDEV_DECIMALS_LIGHT);
+	}
+}
+
+/*
+ * Looks sample number seq, with raw value raw, up in the cache shared
+ * by all open files of this measurement, converting and formatting it
+ * there if nobody has done so yet. Stores the converted value in *value
+ * and copies the line of text to line, unless it is NULL. Returns the
+ * length of the line.
+ */
+static int lunix_chrdev_cached(struct lunix_chrdev_state_struct *state,
+	uint64_t seq, uint16_t raw, unsigned char *line, int32_t *value)
+{
+	struct lunix_chrdev_cache_struct *cache = state->cache;
+	struct lunix_chrdev_cache_slot_struct *slot;
+	uint32_t gen;
+	int len;
+
+	slot = &cache->slot[seq & (LUNIX_MSR_HISTORY - 1)];
+
+	/* The common case, some other open file got here first */
+	gen = ACCESS_ONCE(cache->gen);
+	smp_rmb();
+	if (ACCESS_ONCE(slot->seq) == seq) {
+		smp_rmb();
+		*value = slot->value;
+		len = min_t(int, slot->len, LUNIX_CHRDEV_LINESZ);
+		if (line)
+			memcpy(line, slot->line, len);
+		smp_rmb();
+		if (likely(ACCESS_ONCE(slot->seq) == seq && ACCESS_ONCE(cache->gen) == gen))
+			return len;
+	}
+
+	spin_lock(&cache->lock);
+	if (slot->seq > seq) {
+		/* We are far behind, do not evict newer samples */
+		spin_unlock(&cache->lock);
+		*value = lunix_calib_convert(state->sensor, state->type, raw);
+		if (line)
+			return lunix_chrdev_format(state->type, *value, line);
+		return 0;
+	}
+	if (slot->seq != seq) {
+		slot->seq = 0;
+		smp_wmb();
+		slot->value = lunix_calib_convert(state->sensor, state->type, raw);
+		slot->len = lunix_chrdev_format(state->type, slot->value, slot->line);
+		smp_wmb();
+		slot->seq = seq;
+	}
+	*value = slot->value;
+	len = slot->len;
+	if (line)
+		memcpy(line, slot->line, len);
+	spin_unlock(&cache->lock);
+
+	return len;
+}
+
+/*
+ * Drops everything in a cache, after the conversion of its
+ * measurement has changed, e.g. because of a new calibration
+ */
+static void lunix_chrdev_cache_invalidate(struct lunix_chrdev_cache_struct *cache)
+{
+	unsigned int i;
+
+	if (!cache)
+		return;
+
+	spin_lock(&cache->lock);
+	cache->gen++;
+	smp_wmb();
+	for (i = 0; i < LUNIX_MSR_HISTORY; i++)
+		cache->slot[i].seq = 0;
+	spin_unlock(&cache->lock);
 }
 
 /*
  * Updates the cached state of a character device
  * based on sensor data. Must be called with the
  * character device state lock held.
+ *
+ * Picks up every sample that has arrived since the last update,
+ * [or as many as are still in the sensor history] one per line,
+ * or one per record in binary mode. Under a filter, only the
+ * latest one, and only if the filter lets it through.
  */
 static int lunix_chrdev_state_update(struct lunix_chrdev_state_struct *state)
 {
-	struct lunix_sensor_struct *sensor;
-    unsigned long flags;
-    int new_data;
-    uint16_t portion; /* fract_portion; */
-    long res ; /* res_fract */
-    uint32_t temp, temp1 ;
-    unsigned char temp_buf[20];
+	struct lunix_record_struct *rec = (struct lunix_record_struct *)state->buf_data;
+	struct lunix_msr_data_struct *msr;
+	const struct lunix_msr_sample_struct *sample;
+	struct lunix_msr_sample_struct latest;
+	uint16_t raw[LUNIX_MSR_HISTORY];
+	uint32_t start, n, i;
+	uint64_t seq, first;
+	int32_t value;
+	unsigned long flags;
+	int filtered;
+
+	msr = state->sensor->msr_data[state->type];
+	filtered = lunix_chrdev_filtered(state);
+
 	/*
-	 * Grab the raw data quickly, hold the
-	 * spinlock for as little as possible.
+	 * Grab the raw data quickly, without locking. If the line
+	 * discipline updates the page meanwhile, just try again.
 	 */
-	/* ? */
-	/* Why use spinlocks? See LDD3, p. 119 */
-    
-    debug("going into lunix_chrdev_state_update \n ");
-    spin_lock_irqsave(&sensor->lock, flags );
-    
+	do {
+		start = lunix_msr_read_begin(msr);
+
+		/*
+		 * Any new data available?
+		 */
+		seq = msr->seq;
+		if (seq == state->buf_seq) {
+			n = 0;
+			continue;
+		}
+
+		/* Older samples may have been overwritten already */
+		first = state->buf_seq + 1;
+		if (seq - first >= LUNIX_MSR_HISTORY)
+			first = seq - LUNIX_MSR_HISTORY + 1;
+		if (filtered) {
+			first = seq;
+			latest = *lunix_msr_sample(msr, seq);
+		}
+		n = seq - first + 1;
+
+		/* Records are built in place, values filled in below */
+		if (state->mode == LUNIX_MODE_BINARY)
+			for (i = 0; i < n; i++) {
+				sample = lunix_msr_sample(msr, first + i);
+				rec[i].seq = sample->seq;
+				rec[i].timestamp = sample->timestamp;
+				rec[i].raw = sample->value;
+				rec[i].reserved = 0;
+			}
+		else
+			for (i = 0; i < n; i++)
+				raw[i] = lunix_msr_sample(msr, first + i)->value;
+	} while (lunix_msr_read_retry(msr, start));
+
 	/*
-	 * Any new data available?
+	 * Any new data available? Only trust the answer once the
+	 * snapshot is known to be consistent: seq is 64-bit and
+	 * may have been read in two halves.
 	 */
-	/* ? */
-    
-    new_data = lunix_chrdev_state_needs_refresh(&state);
-    spin_unlock_irqrestore(&sensor->lock, flags);
-    
+	if (!n)
+		return -EAGAIN;
+	if (filtered && !lunix_chrdev_filter_fires(state, &latest))
+		return -EAGAIN;
+
+	if (state->mode == LUNIX_MODE_BINARY) {
+		for (i = 0; i < n; i++)
+			lunix_chrdev_cached(state, rec[i].seq, rec[i].raw,
+				NULL, &rec[i].value);
+		state->buf_lim = n * sizeof(*rec);
+		state->buf_seq = seq;
+		value = rec[n - 1].value;
+		goto out;
+	}
+
 	/*
-	 * Now we can take our time to format them,
-	 * holding only the private state semaphore
+	 * Now we can take our time to format them, holding only the
+	 * private state semaphore, or rather copy them, already
+	 * formatted by another open file
 	 */
-    /* ? */
-    
-    if (down_interruptible(&state->lock)) {
-        debug("Could not acquire lock\n");
-        return -ERESTARTSYS;
-    }
-    if ((new_data) == 1) {
-        debug("there is new data")
-        memcpy(&temp1,((sensor->msr_data[state->type])->values[0]), 4);
-        temp = cpu_to_le32(temp1);
-        memcpy(&portion,&temp,2);
-       /* temp = temp >> 16; */
-       /* memcpy(&integ_portion,&temp,2); */
-        if ((state->type) == 0 ) {
-            res = uint16_to_batt(portion);
-            /* res_fract = uint16_to_batt(fract_portion); */
-        }
-        if ((state->type) == 1 ){
-            res = uint16_to_temp(portion);
-            /* res_fract = uint16_to_temp(fract_portion); */
-        }
-        if ((state->type) == 2 ){
-            res = uint16_to_light(portion);
-            /* res_fract = uint16_to_light(fract_portion); */
-        }
-        up(&state->lock);
-        sprintf(temp_buf, "%ld" , res);
-        (state->buf_lim) = strlen(temp_buf);
-        memcpy((state->buf_data), &temp_buf, (state->buf_lim));
-        return 0;
-        
-    }
-    
-    else {
-        up(&state->lock);
-        return -EAGAIN;
-    }
+	state->buf_lim = 0;
+	for (i = 0; i < n; i++)
+		state->buf_lim += lunix_chrdev_cached(state, first + i, raw[i],
+			&state->buf_data[state->buf_lim], &value);
+	state->buf_seq = seq;
+
+out:
+	/*
+	 * The reference for the next one: the interval runs from the
+	 * report, which may come well after the sample held back
+	 */
+	if (filtered) {
+		spin_lock_irqsave(&state->ref_lock, flags);
+		state->ref_value = value;
+		state->ref_timestamp = ktime_to_ns(ktime_get());
+		state->ref_valid = 1;
+		spin_unlock_irqrestore(&state->ref_lock, flags);
+	}
 	debug("leaving\n");
 	return 0;
 }
@@ -151,47 +368,76 @@ static int lunix_chrdev_state_update(struct lunix_chrdev_state_struct *state)
 static int lunix_chrdev_open(struct inode *inode, struct file *filp)
 {
 	/* Declarations */
-	/* ? */
-    struct lunix_chrdev_state_struct *temp;
+	struct lunix_chrdev_state_struct *state;
+	struct lunix_chrdev_cache_struct *cache;
+	struct lunix_msr_data_struct *msr;
+	struct lunix_sensor_struct *s;
+	unsigned int sensor, type;
+	uint32_t start;
+	uint64_t seq;
 	int ret;
-    
+
 	debug("entering open\n");
 	ret = -ENODEV;
 	if ((ret = nonseekable_open(inode, filp)) < 0)
 		goto out;
-    
+
 	/*
 	 * Associate this open file with the relevant sensor based on
 	 * the minor number of the device node [/dev/sensor<NO>-<TYPE>]
 	 */
-	
+	sensor = iminor(inode) >> 3;
+	type = iminor(inode) & 7;
+	ret = -ENODEV;
+	if (sensor >= lunix_sensor_cnt || type >= N_LUNIX_MSR)
+		goto out;
+
+	/*
+	 * Nothing may have been heard from this sensor yet,
+	 * allocate it so that we can wait for its first packet
+	 */
+	ret = -ENOMEM;
+	if (!(s = lunix_sensor_get(sensor, GFP_KERNEL)))
+		goto out;
+
+	/* And the cache shared by the open files of this measurement */
+	if (!s->cache[type]) {
+		ret = -ENOMEM;
+		cache = kzalloc(sizeof(*cache), GFP_KERNEL);
+		if (!cache)
+			goto out;
+		spin_lock_init(&cache->lock);
+
+		/* Unless another open() got there first */
+		if (cmpxchg(&s->cache[type], NULL, cache))
+			kfree(cache);
+	}
+
 	/* Allocate a new Lunix character device private state structure */
-	/* ? */
-    
-    temp = kzalloc(sizeof(struct lunix_chrdev_state_struct), GFP_KERNEL);
-    if (!temp) {
+	ret = -ENOMEM;
+	state = kzalloc(sizeof(*state), GFP_KERNEL);
+	if (!state) {
 		printk(KERN_ERR "Failed to allocate memory for Lunix chrdev state struct\n");
 		goto out;
 	}
-    
-    temp->type = iminor(inode)%8;
-    
-    /* temp->sensor = kzalloc(sizeof(struct lunix_sensor_struct), GFP_KERNEL);
-    if (!(temp->sensor)) {
-		printk(KERN_ERR "Failed to allocate memory for Lunix sensor struct\n");
-		goto out_with_lunix_chrdev_state_struct; 
-	}
-     */
-    sema_init(&(temp->lock),1);
-    
-    filp->private_data=temp;
-    
-    debug("completed successfully\n");
-	return 0;
-    
-out_with_lunix_chrdev_state_struct:
-    debug("at out_with_lunix_chrdev_state_struct\n");
-    kfree(temp);
+
+	state->type = type;
+	state->sensor = s;
+	state->cache = s->cache[type];
+	sema_init(&state->lock, 1);
+	spin_lock_init(&state->ref_lock);
+
+	/* The first read reports the most recent sample, if any */
+	msr = state->sensor->msr_data[type];
+	do {
+		start = lunix_msr_read_begin(msr);
+		seq = msr->seq;
+	} while (lunix_msr_read_retry(msr, start));
+	state->buf_seq = seq ? seq - 1 : 0;
+
+	filp->private_data = state;
+	ret = 0;
+
 out:
 	debug("leaving, with ret = %d\n", ret);
 	return ret;
@@ -199,110 +445,485 @@ out:
 
 static int lunix_chrdev_release(struct inode *inode, struct file *filp)
 {
-    debug("entering release");
-   /* kzfree(filp->private_data->lunix_chrdev_state_struct->lunix_sensor_struct);
-    printk(KERN_INFO "Lunix:TNG lunix_sensor_struct unloaded successfully\n"); */
-    kzfree(filp->private_data->lunix_chrdev_state_struct);
-    printk(KERN_INFO "Lunix:TNG lunix_chrdev_state_struct unloaded successfully\n");
-    
+	struct lunix_chrdev_state_struct *state = filp->private_data;
+
+	debug("entering release");
+	if (state->watched) {
+		lunix_sensor_unwatch(state->sensor, &state->watch);
+		hrtimer_cancel(&state->timer);
+	}
+	kfree(state);
 	return 0;
 }
 
 static long lunix_chrdev_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
-	/* Why? */
-	return -EINVAL;
+	struct lunix_chrdev_state_struct *state = filp->private_data;
+	struct lunix_sensor_struct *s = state->sensor;
+	struct lunix_calib_struct calib;
+	struct lunix_filter_struct filter;
+	unsigned long flags;
+	int mode;
+	long ret;
+
+	/* Shared with 32-bit processes through compat_ioctl */
+	BUILD_BUG_ON(sizeof(struct lunix_calib_struct) != 32);
+	BUILD_BUG_ON(sizeof(struct lunix_filter_struct) != 8);
+
+	if (_IOC_TYPE(cmd) != LUNIX_IOC_MAGIC || _IOC_NR(cmd) > LUNIX_IOC_MAXNR)
+		return -ENOTTY;
+
+	if (down_interruptible(&state->lock))
+		return -ERESTARTSYS;
+
+	switch (cmd) {
+	case LUNIX_IOC_SET_MODE:
+		ret = -EFAULT;
+		if (get_user(mode, (int __user *)arg))
+			break;
+		ret = -EINVAL;
+		if (mode != LUNIX_MODE_TEXT && mode != LUNIX_MODE_BINARY)
+			break;
+		/*
+		 * Whatever was cached in the old format is dropped. The file
+		 * position belongs to read(), which rewinds on its next call.
+		 */
+		if (mode != state->mode) {
+			state->mode = mode;
+			state->buf_lim = 0;
+			state->rewind = 1;
+		}
+		ret = 0;
+		break;
+
+	case LUNIX_IOC_GET_MODE:
+		ret = put_user(state->mode, (int __user *)arg) ? -EFAULT : 0;
+		break;
+
+	/*
+	 * Calibration applies to the whole node, whichever
+	 * of its measurements this file happens to be
+	 */
+	case LUNIX_IOC_SET_CALIB:
+	case LUNIX_IOC_RESET_CALIB:
+		ret = -EPERM;
+		if (!capable(CAP_SYS_ADMIN))
+			break;
+		if (cmd == LUNIX_IOC_RESET_CALIB)
+			lunix_calib_reset(s);
+		else {
+			ret = -EFAULT;
+			if (copy_from_user(&calib, (void __user *)arg, sizeof(calib)))
+				break;
+			if ((ret = lunix_calib_set(s, &calib)) < 0)
+				break;
+		}
+		lunix_chrdev_cache_invalidate(s->cache[BATT]);
+		lunix_chrdev_cache_invalidate(s->cache[TEMP]);
+		ret = 0;
+		break;
+
+	/*
+	 * The first filter makes this file a watcher of its sensor,
+	 * for good: readers may already be sleeping on watch.wq.
+	 * It is set up before the filter, which may arm the timer.
+	 * A new filter starts from the next sample to arrive.
+	 */
+	case LUNIX_IOC_SET_FILTER:
+		ret = -EFAULT;
+		if (copy_from_user(&filter, (void __user *)arg, sizeof(filter)))
+			break;
+		if (!state->watched && (filter.deadband || filter.interval)) {
+			hrtimer_init(&state->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+			state->timer.function = lunix_chrdev_timer;
+			state->watch.fire = lunix_chrdev_watch_fire;
+			lunix_sensor_watch(s, &state->watch);
+			state->watched = 1;
+		}
+		spin_lock_irqsave(&state->ref_lock, flags);
+		state->ref_valid = 0;
+		state->filter = filter;
+		spin_unlock_irqrestore(&state->ref_lock, flags);
+		ret = 0;
+		break;
+
+	case LUNIX_IOC_GET_FILTER:
+		ret = copy_to_user((void __user *)arg, &state->filter,
+			sizeof(state->filter)) ? -EFAULT : 0;
+		break;
+
+	case LUNIX_IOC_GET_CALIB:
+		lunix_calib_get(s, &calib);
+		ret = copy_to_user((void __user *)arg, &calib, sizeof(calib)) ? -EFAULT : 0;
+		break;
+
+	default:
+		ret = -ENOTTY;
+		break;
+	}
+
+	up(&state->lock);
+	return ret;
 }
 
 static ssize_t lunix_chrdev_read(struct file *filp, char __user *usrbuf, size_t cnt, loff_t *f_pos)
 {
 	ssize_t ret;
-    
+
 	struct lunix_sensor_struct *sensor;
 	struct lunix_chrdev_state_struct *state;
-    
+
 	state = filp->private_data;
 	WARN_ON(!state);
-    
+
 	sensor = state->sensor;
 	WARN_ON(!sensor);
-    
-	/* Lock? */
-    debug("entering read /n");
-    if (down_interruptible(&state->lock)) {
-        debug("Could not acquire lock\n");
-        return -ERESTARTSYS;
-    }
-    
+
+	if (down_interruptible(&state->lock))
+		return -ERESTARTSYS;
+
+	/* Binary mode only hands out whole records */
+	if (state->mode == LUNIX_MODE_BINARY) {
+		cnt -= cnt % sizeof(struct lunix_record_struct);
+		if (!cnt) {
+			ret = -EINVAL;
+			goto out;
+		}
+	}
+
 	/*
 	 * If the cached character device state needs to be
 	 * updated by actual sensor data (i.e. we need to report
 	 * on a "fresh" measurement, do so
 	 */
+	if (state->rewind) {
+		*f_pos = 0;
+		state->rewind = 0;
+	}
 	if (*f_pos == 0) {
 		while (lunix_chrdev_state_update(state) == -EAGAIN) {
-			/* ? */
+			/*
+			 * Nothing new. Checked on every read, so that
+			 * fcntl(F_SETFL) takes effect right away.
+			 */
+			if (filp->f_flags & O_NONBLOCK) {
+				ret = -EAGAIN;
+				goto out;
+			}
+
 			/* The process needs to sleep */
-			/* See LDD3, page 153 for a hint */
-            debug("going to sleep");
-            up(&state->lock); /* release the lock */
-            if (wait_event_interruptible(sensor->wq, (lunix_chrdev_state_update(state) != -EAGAIN)))
-                return -ERESTARTSYS;
-            debug("wake up from sleep");
-            if (down_interruptible(&state->lock)) {
-                debug("Could not acquire lock\n"); /* acquire again the lock */
-                return -ERESTARTSYS;
-            }
-        }
+			up(&state->lock);
+			if (wait_event_interruptible(*lunix_chrdev_wq(state),
+				lunix_chrdev_state_needs_refresh(state)))
+				return -ERESTARTSYS;
+			if (down_interruptible(&state->lock))
+				return -ERESTARTSYS;
+		}
 	}
-    /* End of file */
-	/* ? */
-	
+
 	/* Determine the number of cached bytes to copy to userspace */
-	/* ? */
-    while (((*f_pos) < cnt ) and ((*f_pos) < (state->buf_lim))) {
-        if (cnt < buf_lim){
-            if (copy_to_user(usrbuf, state->buf_data, cnt)){
-                return -EFAULT;
-            *f_pos += cnt;
-            }
-        }
-        else {
-            if (copy_to_user(usrbuf, state->buf_data, state->buf_lim))
-                return -EFAULT;
-            *f_pos += state->buf_lim ;
-        }
-    }
-    ret=*f_pos;
-    
-	/* Auto-rewind on EOF mode? */
-	/* ? */
-    
-    if (*f_pos == state->buf_lim){
-        *f_pos=0;
-    }
-        
+	if (cnt > state->buf_lim - *f_pos)
+		cnt = state->buf_lim - *f_pos;
+	if (copy_to_user(usrbuf, &state->buf_data[*f_pos], cnt)) {
+		ret = -EFAULT;
+		goto out;
+	}
+	*f_pos += cnt;
+	ret = cnt;
+
+	/* Auto-rewind on EOF mode */
+	if (*f_pos == state->buf_lim)
+		*f_pos = 0;
+
 out:
-	/* Unlock? */
-    up(&state->lock);
+	up(&state->lock);
 	return ret;
 }
 
+/*
+ * A file is readable when there is a new measurement [that passes
+ * its filter], or when part of the last one is still waiting to be
+ * read. The line discipline wakes up sensor->wq on every update,
+ * the watch.wq of a filtered file only when it becomes readable.
+ */
+static unsigned int lunix_chrdev_poll(struct file *filp, poll_table *wait)
+{
+	struct lunix_chrdev_state_struct *state = filp->private_data;
+	unsigned int mask = 0;
+
+	WARN_ON(!state);
+
+	poll_wait(filp, lunix_chrdev_wq(state), wait);
+	if ((filp->f_pos != 0 && !ACCESS_ONCE(state->rewind)) ||
+	    lunix_chrdev_state_needs_refresh(state))
+		mask |= POLLIN | POLLRDNORM;
+
+	return mask;
+}
+
+/*
+ * Maps the measurement page behind this device node, read-only,
+ * so that readers can follow the lockless protocol described in
+ * lunix.h [see lunix-user.h] without a system call per sample.
+ */
 static int lunix_chrdev_mmap(struct file *filp, struct vm_area_struct *vma)
 {
-	return -EINVAL;
+	struct lunix_chrdev_state_struct *state = filp->private_data;
+	struct lunix_msr_data_struct *msr;
+
+	if (vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start > PAGE_SIZE)
+		return -EINVAL;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	/* Sensors, and their pages, live until the module is unloaded */
+	msr = state->sensor->msr_data[state->type];
+	return remap_pfn_range(vma, vma->vm_start, virt_to_phys(msr) >> PAGE_SHIFT,
+		vma->vm_end - vma->vm_start, vma->vm_page_prot);
 }
 
+#ifdef CONFIG_COMPAT
+/*
+ * 32-bit processes: the argument layouts are the same, only
+ * the pointers need converting
+ */
+static long lunix_chrdev_compat_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	return lunix_chrdev_ioctl(filp, cmd, (unsigned long)compat_ptr(arg));
+}
+#endif
+
 static struct file_operations lunix_chrdev_fops =
 {
     .owner          = THIS_MODULE,
 	.open           = lunix_chrdev_open,
 	.release        = lunix_chrdev_release,
 	.read           = lunix_chrdev_read,
+	.poll           = lunix_chrdev_poll,
 	.unlocked_ioctl = lunix_chrdev_ioctl,
+#ifdef CONFIG_COMPAT
+	.compat_ioctl   = lunix_chrdev_compat_ioctl,
+#endif
 	.mmap           = lunix_chrdev_mmap
 };
 
+/*************************************
+ * /dev/lunix-all: the latest values of
+ * every sensor, see lunix_all_header_struct
+ *************************************/
+
+static int lunix_all_open(struct inode *inode, struct file *filp)
+{
+	return nonseekable_open(inode, filp);
+}
+
+/*
+ * Fills in the snapshot entry of sensor number id from the region,
+ * consistently, since all of its values are covered by seqcount[id].
+ */
+static void lunix_all_snapshot_entry(unsigned int id, struct lunix_snapshot_entry_struct *e)
+{
+	const uint32_t *seqcount = lunix_all_array(lunix_all, seqcount);
+	struct lunix_sensor_struct *s;
+	uint32_t start;
+
+	do {
+		start = lunix_read_begin(&seqcount[id]);
+		e->seq = ((uint64_t *)lunix_all_array(lunix_all, seq))[id];
+		e->timestamp = ((uint64_t *)lunix_all_array(lunix_all, timestamp))[id];
+		e->raw[BATT] = ((uint16_t *)lunix_all_array(lunix_all, batt))[id];
+		e->raw[TEMP] = ((uint16_t *)lunix_all_array(lunix_all, temp))[id];
+		e->raw[LIGHT] = ((uint16_t *)lunix_all_array(lunix_all, light))[id];
+	} while (lunix_read_retry(&seqcount[id], start));
+
+	e->reserved = 0;
+	e->pad = 0;
+	if (e->seq) {
+		s = lunix_sensor_lookup(id);
+		e->value[BATT] = lunix_calib_convert(s, BATT, e->raw[BATT]);
+		e->value[TEMP] = lunix_calib_convert(s, TEMP, e->raw[TEMP]);
+		e->value[LIGHT] = lunix_calib_convert(s, LIGHT, e->raw[LIGHT]);
+	} else
+		e->value[BATT] = e->value[TEMP] = e->value[LIGHT] = 0;
+}
+
+/*
+ * snap.entries is a user pointer too, converted with compat_ptr()
+ * for 32-bit processes
+ */
+static long lunix_all_do_ioctl(struct file *filp, unsigned int cmd,
+	void __user *arg, int compat)
+{
+	struct lunix_snapshot_entry_struct e[8];
+	struct lunix_snapshot_struct snap;
+	struct lunix_snapshot_entry_struct __user *entries;
+	struct lunix_stats_struct st;
+	uint32_t i, n, done;
+
+	/* Shared with 32-bit processes through compat_ioctl */
+	BUILD_BUG_ON(sizeof(struct lunix_snapshot_entry_struct) != 40);
+	BUILD_BUG_ON(sizeof(struct lunix_snapshot_struct) != 16);
+	BUILD_BUG_ON(sizeof(struct lunix_stats_struct) != 64);
+
+	if (cmd == LUNIX_IOC_GET_STATS) {
+		lunix_ldisc_get_stats(&st);
+		if (copy_to_user(arg, &st, sizeof(st)))
+			return -EFAULT;
+		return 0;
+	}
+	if (cmd != LUNIX_IOC_SNAPSHOT)
+		return -ENOTTY;
+
+	if (copy_from_user(&snap, arg, sizeof(snap)))
+		return -EFAULT;
+	if (compat)
+		entries = compat_ptr((compat_uptr_t)snap.entries);
+	else
+		entries = (void __user *)(unsigned long)snap.entries;
+
+	if (snap.first >= lunix_all->nsensors)
+		snap.count = 0;
+	else if (snap.count > lunix_all->nsensors - snap.first)
+		snap.count = lunix_all->nsensors - snap.first;
+
+	/* Copy out a few entries at a time, the stack is small */
+	for (done = 0; done < snap.count; done += n) {
+		n = min_t(uint32_t, snap.count - done, ARRAY_SIZE(e));
+		for (i = 0; i < n; i++)
+			lunix_all_snapshot_entry(snap.first + done + i, &e[i]);
+		if (copy_to_user(&entries[done], e, n * sizeof(e[0])))
+			return -EFAULT;
+	}
+
+	if (copy_to_user(arg, &snap, sizeof(snap)))
+		return -EFAULT;
+	return 0;
+}
+
+static long lunix_all_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	return lunix_all_do_ioctl(filp, cmd, (void __user *)arg, 0);
+}
+
+#ifdef CONFIG_COMPAT
+static long lunix_all_compat_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	return lunix_all_do_ioctl(filp, cmd, compat_ptr(arg), 1);
+}
+#endif
+
+/*
+ * The region is shared by everyone, map it read-only
+ */
+static int lunix_all_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	return remap_vmalloc_range(vma, lunix_all, vma->vm_pgoff);
+}
+
+static struct file_operations lunix_all_fops =
+{
+	.owner          = THIS_MODULE,
+	.open           = lunix_all_open,
+	.unlocked_ioctl = lunix_all_ioctl,
+#ifdef CONFIG_COMPAT
+	.compat_ioctl   = lunix_all_compat_ioctl,
+#endif
+	.mmap           = lunix_all_mmap
+};
+
+/*************************************
+ * /dev/lunix-events: every update of
+ * every sensor, in arrival order
+ *************************************/
+
+static int lunix_events_chrdev_open(struct inode *inode, struct file *filp)
+{
+	int ret;
+
+	if ((ret = nonseekable_open(inode, filp)) < 0)
+		return ret;
+	if (!(filp->private_data = lunix_events_open()))
+		return -ENOMEM;
+	return 0;
+}
+
+static int lunix_events_chrdev_release(struct inode *inode, struct file *filp)
+{
+	lunix_events_close(filp->private_data);
+	return 0;
+}
+
+/*
+ * Returns as many whole events as fit in usrbuf and are queued,
+ * sleeping only if there are none [and O_NONBLOCK is not set].
+ * Never returns 0: threads sharing the file may empty the ring
+ * between the wakeup and the fetch, in which case we wait again.
+ */
+static ssize_t lunix_events_chrdev_read(struct file *filp, char __user *usrbuf,
+	size_t cnt, loff_t *f_pos)
+{
+	struct lunix_events_reader_struct *r = filp->private_data;
+	struct lunix_event_struct ev[8];
+	size_t done;
+	int n, max;
+
+	if (cnt < sizeof(ev[0]))
+		return -EINVAL;
+
+	if (mutex_lock_interruptible(&r->read_lock))
+		return -ERESTARTSYS;
+
+	max = min_t(size_t, cnt / sizeof(ev[0]), ARRAY_SIZE(ev));
+	while (!(n = lunix_events_peek(r, ev, max))) {
+		mutex_unlock(&r->read_lock);
+		if (filp->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if (wait_event_interruptible(r->wq, lunix_events_pending(r)))
+			return -ERESTARTSYS;
+		if (mutex_lock_interruptible(&r->read_lock))
+			return -ERESTARTSYS;
+	}
+
+	/*
+	 * Events leave the ring only once they have been copied, so a
+	 * bad buffer loses nothing; they are returned by the next read()
+	 */
+	for (done = 0; n; done += n * sizeof(ev[0])) {
+		if (copy_to_user(usrbuf + done, ev, n * sizeof(ev[0])))
+			break;
+		lunix_events_consume(r, n);
+
+		/* And whatever else fits */
+		max = min_t(size_t, (cnt - done) / sizeof(ev[0]) - n, ARRAY_SIZE(ev));
+		n = max ? lunix_events_peek(r, ev, max) : 0;
+	}
+	mutex_unlock(&r->read_lock);
+
+	return done ? done : -EFAULT;
+}
+
+static unsigned int lunix_events_chrdev_poll(struct file *filp, poll_table *wait)
+{
+	struct lunix_events_reader_struct *r = filp->private_data;
+
+	poll_wait(filp, &r->wq, wait);
+	return lunix_events_pending(r) ? POLLIN | POLLRDNORM : 0;
+}
+
+static struct file_operations lunix_events_fops =
+{
+	.owner          = THIS_MODULE,
+	.open           = lunix_events_chrdev_open,
+	.release        = lunix_events_chrdev_release,
+	.read           = lunix_events_chrdev_read,
+	.poll           = lunix_events_chrdev_poll
+};
+
 int lunix_chrdev_init(void)
 {
 	/*
@@ -333,9 +954,42 @@ int lunix_chrdev_init(void)
 		debug("failed to add character device\n");
 		goto out_with_chrdev_region;
 	}
+
+	/*
+	 * And the devices that are not bound to a single sensor
+	 */
+	cdev_init(&lunix_all_cdev, &lunix_all_fops);
+	lunix_all_cdev.owner = THIS_MODULE;
+	cdev_init(&lunix_events_cdev, &lunix_events_fops);
+	lunix_events_cdev.owner = THIS_MODULE;
+
+	ret = register_chrdev_region(MKDEV(LUNIX_CHRDEV_MAJOR, LUNIX_CHRDEV_MINOR_ALL),
+		LUNIX_CHRDEV_SPECIAL_CNT, "Lunix:TNG");
+	if (ret < 0) {
+		debug("failed to register region for special devices, ret = %d\n", ret);
+		goto out_with_cdev;
+	}
+	ret = cdev_add(&lunix_all_cdev, MKDEV(LUNIX_CHRDEV_MAJOR, LUNIX_CHRDEV_MINOR_ALL), 1);
+	if (ret < 0) {
+		debug("failed to add lunix-all character device\n");
+		goto out_with_special_region;
+	}
+	ret = cdev_add(&lunix_events_cdev, MKDEV(LUNIX_CHRDEV_MAJOR, LUNIX_CHRDEV_MINOR_EVENTS), 1);
+	if (ret < 0) {
+		debug("failed to add lunix-events character device\n");
+		goto out_with_all_cdev;
+	}
+
 	debug("completed successfully\n");
 	return 0;
-    
+
+out_with_all_cdev:
+	cdev_del(&lunix_all_cdev);
+out_with_special_region:
+	unregister_chrdev_region(MKDEV(LUNIX_CHRDEV_MAJOR, LUNIX_CHRDEV_MINOR_ALL),
+		LUNIX_CHRDEV_SPECIAL_CNT);
+out_with_cdev:
+	cdev_del(&lunix_chrdev_cdev);
 out_with_chrdev_region:
 	unregister_chrdev_region(dev_no, lunix_minor_cnt);
 out:
@@ -349,6 +1003,10 @@ void lunix_chrdev_destroy(void)
     
 	debug("entering\n");
 	dev_no = MKDEV(LUNIX_CHRDEV_MAJOR, 0);
+	cdev_del(&lunix_events_cdev);
+	cdev_del(&lunix_all_cdev);
+	unregister_chrdev_region(MKDEV(LUNIX_CHRDEV_MAJOR, LUNIX_CHRDEV_MINOR_ALL),
+		LUNIX_CHRDEV_SPECIAL_CNT);
 	cdev_del(&lunix_chrdev_cdev);
 	unregister_chrdev_region(dev_no, lunix_minor_cnt);
 	debug("leaving\n");
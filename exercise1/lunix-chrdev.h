@@ -10,21 +10,156 @@
 #ifndef _LUNIX_CHRDEV_H
 #define _LUNIX_CHRDEV_H
 
+#include "lunix.h"
+
 /*
  * Lunix:TNG character device
  */
 #define LUNIX_CHRDEV_MAJOR	60	/* Reserved for local / experimental use */
-#define LUNIX_CHRDEV_BUFSZ      20      /* Buffer size used to hold textual info */
+#define LUNIX_CHRDEV_LINESZ     20      /* Space for one sample as text */
+
+/*
+ * Minor numbers of the devices that are not bound to a single sensor,
+ * right above those of the largest possible sensor number [65534]
+ */
+#define LUNIX_CHRDEV_MINOR_ALL     (65535 << 3)                  /* /dev/lunix-all */
+#define LUNIX_CHRDEV_MINOR_EVENTS  (LUNIX_CHRDEV_MINOR_ALL + 1)  /* /dev/lunix-events */
+#define LUNIX_CHRDEV_SPECIAL_CNT   2
+
+/*
+ * In binary mode [see LUNIX_IOC_SET_MODE], every read() returns
+ * an integral number of the following records, one per sample,
+ * instead of lines of text.
+ */
+#define LUNIX_MODE_TEXT		0
+#define LUNIX_MODE_BINARY	1
+
+struct lunix_record_struct {
+	uint64_t seq;		/* Sample number, see lunix_msr_data_struct */
+	uint64_t timestamp;	/* CLOCK_MONOTONIC, in ns */
+	uint16_t raw;		/* As sent by the sensor */
+	uint16_t reserved;
+	int32_t value;		/* Converted, in thousandths [mV, m°C, ...] */
+};
+
+/*
+ * A consistent snapshot of the latest values of sensors first to
+ * first + count - 1, in one LUNIX_IOC_SNAPSHOT call on /dev/lunix-all.
+ * Entry i describes sensor number first + i; seq tells how many updates
+ * it has seen [0: none yet], so callers can skip entries that have not
+ * changed since their previous snapshot.
+ *
+ * Padded to a multiple of 8 bytes, so that 32-bit processes, whose
+ * uint64_t is only 4-byte aligned, see the same 40-byte layout.
+ */
+struct lunix_snapshot_entry_struct {
+	uint64_t seq;
+	uint64_t timestamp;		/* CLOCK_MONOTONIC, in ns */
+	uint16_t raw[3];		/* Battery, temperature, light */
+	uint16_t reserved;
+	int32_t value[3];		/* Converted, in thousandths */
+	uint32_t pad;
+};
+
+struct lunix_snapshot_struct {
+	uint32_t first;
+	uint32_t count;			/* In: room in entries, out: entries filled */
+	uint64_t entries;		/* User pointer to the entries */
+};
+
+/*
+ * Reporting filter of an open file [see LUNIX_IOC_SET_FILTER]. With
+ * one set, a read reports only the latest sample, and only once it
+ * differs from the last one reported by at least the deadband and the
+ * interval has passed since; sleepers are not woken up before that.
+ * A change held back only by the interval is reported when it ends,
+ * whether or not the sensor sends anything else meanwhile.
+ */
+struct lunix_filter_struct {
+	uint32_t deadband;		/* In thousandths of a unit [500: 0.5 °C], 0: none */
+	uint32_t interval;		/* In ms, 0: none */
+};
+
+/*
+ * Receive counters of the line discipline [LUNIX_IOC_GET_STATS on
+ * /dev/lunix-all], summed over every TTY it has been attached to
+ * since the module was loaded, including those closed since.
+ */
+struct lunix_stats_struct {
+	uint64_t ttys;			/* Currently attached */
+	uint64_t rx_packets;		/* Valid packets received */
+	uint64_t rx_crc_errors;		/* Packets dropped due to bad CRC */
+	uint64_t rx_resyncs;		/* Packets abandoned due to framing errors */
+	uint64_t rx_skipped;		/* Bytes skipped looking for a start byte */
+	uint64_t rx_coalesced;		/* Wakeups saved by batching */
+	uint64_t rx_overruns;		/* Bytes dropped, deferred ring was full */
+	uint64_t rx_nomem;		/* Packets dropped, no memory for a new sensor */
+};
+
+/*
+ * Calibration of a sensor node [see LUNIX_IOC_SET_CALIB], in fixed
+ * point: the temperature is that of a thermistor in a voltage divider
+ * with resistor r1, following the Steinhart-Hart equation
+ *
+ *	1 / T = a + b ln(R) + c ln(R)^3
+ *
+ * and the battery voltage is batt_ref * 1023 / raw. Nodes that have
+ * not been calibrated use the following defaults.
+ */
+struct lunix_calib_struct {
+	int64_t sh_a;			/* Steinhart-Hart coefficients, in units of 10^-12 */
+	int64_t sh_b;
+	int64_t sh_c;
+	uint32_t r1;			/* In mOhm */
+	uint32_t batt_ref;		/* In uV */
+};
+
+#define LUNIX_CALIB_SH_A	1010024000LL
+#define LUNIX_CALIB_SH_B	242127000LL
+#define LUNIX_CALIB_SH_C	146000LL
+#define LUNIX_CALIB_R1		10000000U
+#define LUNIX_CALIB_BATT_REF	1223000U
+
+/* Buffer size used to hold cached info, enough for a whole history */
+#define LUNIX_CHRDEV_BUFSZ      (LUNIX_MSR_HISTORY * sizeof(struct lunix_record_struct))
 
-/* Compile-time parameters */
+/*
+ * Compile-time parameters
+ *
+ * Text mode reports values in units [V, °C, ...] with a fixed number
+ * of decimals per measurement, at most 3: they are kept in thousandths.
+ */
+#define LUNIX_CHRDEV_DECIMALS_BATT	3
+#define LUNIX_CHRDEV_DECIMALS_TEMP	2
+#define LUNIX_CHRDEV_DECIMALS_LIGHT	1
 
 #ifdef __KERNEL__ 
 
 #include <linux/fs.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
+#include <linux/hrtimer.h>
+#include <linux/spinlock.h>
 
-#include "lunix.h"
+/*
+ * The converted value and line of text of every sample in the history
+ * of a measurement, produced once by whichever open file needs them
+ * first and copied by all the others. Sample number seq lives in
+ * slot[seq % LUNIX_MSR_HISTORY]; the slot seq is 0 while it is being
+ * filled, so readers check it before and after copying, without locking.
+ */
+struct lunix_chrdev_cache_slot_struct {
+	uint64_t seq;
+	int32_t value;
+	uint8_t len;
+	unsigned char line[LUNIX_CHRDEV_LINESZ];
+};
+
+struct lunix_chrdev_cache_struct {
+	spinlock_t lock;		/* Serializes open files filling slots */
+	uint32_t gen;			/* Bumped when all slots are dropped */
+	struct lunix_chrdev_cache_slot_struct slot[LUNIX_MSR_HISTORY];
+};
 
 /*
  * Private state for an open character device node
@@ -32,17 +167,40 @@
 struct lunix_chrdev_state_struct {
 	enum lunix_msr_enum type;
 	struct lunix_sensor_struct *sensor;
+	struct lunix_chrdev_cache_struct *cache;
 
-	/* A buffer used to hold cached textual info */
+	/*
+	 * A buffer used to hold cached info, one line of text
+	 * or one record for every sample up to sequence number buf_seq
+	 */
+	int mode;
+	int rewind;			/* Start over at the next read, buf_data was dropped */
 	int buf_lim;
-	unsigned char buf_data[LUNIX_CHRDEV_BUFSZ];
-	uint32_t buf_timestamp;
+	unsigned char buf_data[LUNIX_CHRDEV_BUFSZ] __aligned(8);
+	uint64_t buf_seq;
 
+	/*
+	 * Blocking vs. non-blocking reads follow O_NONBLOCK
+	 * in the file flags, and need no state of their own
+	 */
 	struct semaphore lock;
 
 	/*
-	 * Fixme: Any mode settings? e.g. blocking vs. non-blocking
+	 * The reporting filter, and the last value reported under it
+	 * and when [CLOCK_MONOTONIC, in ns].
+	 * A file that has ever had a filter set is a watcher of its
+	 * sensor from then on, and its readers sleep on watch.wq; the
+	 * timer wakes them up when a change held back by the interval
+	 * is due.
 	 */
+	spinlock_t ref_lock;		/* Covers the filter and the reference */
+	struct lunix_filter_struct filter;
+	int ref_valid;
+	int32_t ref_value;
+	uint64_t ref_timestamp;
+	int watched;
+	struct lunix_sensor_watch_struct watch;
+	struct hrtimer timer;
 };
 
 /*
@@ -59,9 +217,17 @@ void lunix_chrdev_destroy(void);
  * Definition of ioctl commands
  */
 #define LUNIX_IOC_MAGIC			LUNIX_CHRDEV_MAJOR
-//#define LUNIX_IOC_EXAMPLE		_IOR(LUNIX_IOC_MAGIC, 0, void *)
-
-#define LUNIX_IOC_MAXNR			0	
+#define LUNIX_IOC_SET_MODE		_IOW(LUNIX_IOC_MAGIC, 0, int)
+#define LUNIX_IOC_GET_MODE		_IOR(LUNIX_IOC_MAGIC, 1, int)
+#define LUNIX_IOC_SNAPSHOT		_IOWR(LUNIX_IOC_MAGIC, 2, struct lunix_snapshot_struct)
+#define LUNIX_IOC_SET_CALIB		_IOW(LUNIX_IOC_MAGIC, 3, struct lunix_calib_struct)
+#define LUNIX_IOC_GET_CALIB		_IOR(LUNIX_IOC_MAGIC, 4, struct lunix_calib_struct)
+#define LUNIX_IOC_RESET_CALIB		_IO(LUNIX_IOC_MAGIC, 5)
+#define LUNIX_IOC_SET_FILTER		_IOW(LUNIX_IOC_MAGIC, 6, struct lunix_filter_struct)
+#define LUNIX_IOC_GET_FILTER		_IOR(LUNIX_IOC_MAGIC, 7, struct lunix_filter_struct)
+#define LUNIX_IOC_GET_STATS		_IOR(LUNIX_IOC_MAGIC, 8, struct lunix_stats_struct)
+
+#define LUNIX_IOC_MAXNR			8
 
 #endif	/* _LUNIX_H */
 
@@ -0,0 +1,132 @@
+/*
+ * lunix-convert.h
+ *
+ * Batch conversion of raw Lunix:TNG measurements to thousandths of a
+ * unit, for userspace: dashboards going over sample histories [see
+ * lunix-user.h], snapshots or binary records, and the offline tools.
+ *
+ * Whole arrays are converted, eight values at a time with AVX2 when
+ * the compiler targets it [e.g. -mavx2 or -march=native], otherwise
+ * one at a time. The routines take the tables in the format emitted
+ * by mk_lookup_tables; include lunix-lookup.h first to also get
+ * wrappers using its tables, which only hold for uncalibrated nodes.
+ *
+ */
+
+#ifndef _LUNIX_CONVERT_H
+#define _LUNIX_CONVERT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#define LUNIX_CONVERT_IMPL	"avx2"
+#else
+#define LUNIX_CONVERT_IMPL	"scalar"
+#endif
+
+/*
+ * out[i] = table[min(raw[i], fs)], e.g. temperature
+ */
+static inline void lunix_convert_clamped(const int32_t *table, unsigned int fs,
+	const uint16_t *raw, int32_t *out, size_t n)
+{
+	size_t i = 0;
+#ifdef __AVX2__
+	const __m256i vfs = _mm256_set1_epi32(fs);
+	__m256i r;
+
+	for (; i < (n & ~(size_t)7); i += 8) {
+		r = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)&raw[i]));
+		r = _mm256_min_epu32(r, vfs);
+		_mm256_storeu_si256((__m256i *)&out[i],
+			_mm256_i32gather_epi32((const int *)table, r, 4));
+	}
+#endif
+	for (; i < n; i++)
+		out[i] = table[raw[i] < fs ? raw[i] : fs];
+}
+
+/*
+ * out[i] = raw[i] <= fs ? table[raw[i]] : num / raw[i], e.g. battery.
+ * Raw values past full scale do not come from a working ADC, so
+ * vectors holding any are patched up one value at a time.
+ */
+static inline void lunix_convert_reciprocal(const int32_t *table, unsigned int fs,
+	uint32_t num, const uint16_t *raw, int32_t *out, size_t n)
+{
+	size_t i = 0, j;
+#ifdef __AVX2__
+	const __m256i vfs = _mm256_set1_epi32(fs);
+	__m256i r, over;
+
+	for (; i < (n & ~(size_t)7); i += 8) {
+		r = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)&raw[i]));
+		over = _mm256_cmpgt_epi32(r, vfs);
+		r = _mm256_min_epu32(r, vfs);
+		_mm256_storeu_si256((__m256i *)&out[i],
+			_mm256_i32gather_epi32((const int *)table, r, 4));
+		if (!_mm256_testz_si256(over, over))
+			for (j = i; j < i + 8; j++)
+				if (raw[j] > fs)
+					out[j] = (int32_t)(num / raw[j]);
+	}
+#endif
+	for (j = i; j < n; j++)
+		out[j] = raw[j] <= fs ? table[raw[j]] : (int32_t)(num / raw[j]);
+}
+
+/*
+ * out[i] = raw[i] * (q * 65535 + r) / 65535, e.g. light, with r < 65535.
+ * x / 65535 == (x + (x >> 16) + 1) >> 16 for every x < 65535 * 65536,
+ * which covers r * raw[i], so no division is needed.
+ */
+static inline void lunix_convert_linear(uint32_t q, uint32_t r,
+	const uint16_t *raw, int32_t *out, size_t n)
+{
+	uint32_t x;
+	size_t i = 0;
+#ifdef __AVX2__
+	const __m256i vq = _mm256_set1_epi32(q), vr = _mm256_set1_epi32(r);
+	const __m256i one = _mm256_set1_epi32(1);
+	__m256i v, vx;
+
+	for (; i < (n & ~(size_t)7); i += 8) {
+		v = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)&raw[i]));
+		vx = _mm256_mullo_epi32(v, vr);
+		vx = _mm256_srli_epi32(_mm256_add_epi32(_mm256_add_epi32(vx,
+			_mm256_srli_epi32(vx, 16)), one), 16);
+		_mm256_storeu_si256((__m256i *)&out[i],
+			_mm256_add_epi32(_mm256_mullo_epi32(v, vq), vx));
+	}
+#endif
+	for (; i < n; i++) {
+		x = r * raw[i];
+		out[i] = q * raw[i] + ((x + (x >> 16) + 1) >> 16);
+	}
+}
+
+/*
+ * With the default tables, those of nodes that have not been
+ * calibrated; lunix-user.h builds the tables of any node.
+ */
+#ifdef LUNIX_LOOKUP_ADC_FS
+static inline void lunix_convert_batt(const uint16_t *raw, int32_t *out, size_t n)
+{
+	lunix_convert_reciprocal(lookup_voltage, LUNIX_LOOKUP_ADC_FS,
+		LUNIX_LOOKUP_BATT_NUM, raw, out, n);
+}
+
+static inline void lunix_convert_temp(const uint16_t *raw, int32_t *out, size_t n)
+{
+	lunix_convert_clamped(lookup_temperature, LUNIX_LOOKUP_ADC_FS, raw, out, n);
+}
+
+static inline void lunix_convert_light(const uint16_t *raw, int32_t *out, size_t n)
+{
+	lunix_convert_linear(LUNIX_LOOKUP_LIGHT_Q, LUNIX_LOOKUP_LIGHT_R, raw, out, n);
+}
+#endif
+
+#endif	/* _LUNIX_CONVERT_H */
@@ -0,0 +1,175 @@
+/*
+ * lunix-events.c
+ *
+ * Event stream for Lunix:TNG: every sensor update,
+ * from any node, in arrival order
+ *
+ */
+
+#include <linux/list.h>
+#include <linux/slab.h>
+#include <linux/wait.h>
+#include <linux/kernel.h>
+#include <linux/vmalloc.h>
+#include <linux/spinlock.h>
+#include <linux/circ_buf.h>
+
+#include "lunix.h"
+#include "lunix-events.h"
+
+/*
+ * Open readers, and the contents of their rings. Posting takes the
+ * lock only while somebody is reading, and only for a few stores per
+ * reader, so TTYs updating different sensors hardly ever meet here.
+ *
+ * The lock is always taken with interrupts off: posting happens in
+ * the receive path of the TTY, which some drivers run from their
+ * interrupt handler [low_latency].
+ */
+static LIST_HEAD(lunix_events_readers);
+static DEFINE_SPINLOCK(lunix_events_lock);
+
+struct lunix_events_reader_struct *lunix_events_open(void)
+{
+	struct lunix_events_reader_struct *r;
+	unsigned long flags;
+
+	r = kzalloc(sizeof(*r), GFP_KERNEL);
+	if (!r)
+		goto out;
+	r->ring = vmalloc(LUNIX_EVENTS_RING * sizeof(*r->ring));
+	if (!r->ring)
+		goto out_with_reader;
+	init_waitqueue_head(&r->wq);
+	mutex_init(&r->read_lock);
+
+	spin_lock_irqsave(&lunix_events_lock, flags);
+	list_add_tail(&r->list, &lunix_events_readers);
+	spin_unlock_irqrestore(&lunix_events_lock, flags);
+
+	return r;
+
+out_with_reader:
+	kfree(r);
+out:
+	return NULL;
+}
+
+void lunix_events_close(struct lunix_events_reader_struct *r)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&lunix_events_lock, flags);
+	list_del(&r->list);
+	spin_unlock_irqrestore(&lunix_events_lock, flags);
+
+	debug("reader lost %u events\n", r->overruns);
+	vfree(r->ring);
+	kfree(r);
+}
+
+/*
+ * Just a quick [unlocked] check, for wait_event() and poll()
+ */
+int lunix_events_pending(struct lunix_events_reader_struct *r)
+{
+	return ACCESS_ONCE(r->head) != ACCESS_ONCE(r->tail);
+}
+
+/*
+ * Moves up to max of the oldest events of reader r to ev,
+ * returns how many were moved.
+ */
+int lunix_events_fetch(struct lunix_events_reader_struct *r,
+	struct lunix_event_struct *ev, int max)
+{
+	unsigned long flags;
+	int i, n;
+
+	spin_lock_irqsave(&lunix_events_lock, flags);
+	n = CIRC_CNT(r->head, r->tail, LUNIX_EVENTS_RING);
+	if (n > max)
+		n = max;
+	for (i = 0; i < n; i++) {
+		ev[i] = r->ring[r->tail];
+		r->tail = (r->tail + 1) & (LUNIX_EVENTS_RING - 1);
+	}
+	spin_unlock_irqrestore(&lunix_events_lock, flags);
+
+	return n;
+}
+
+/*
+ * Copies up to max of the oldest events of reader r to ev, leaving
+ * them queued, returns how many were copied. They are only dropped by
+ * lunix_events_consume(), once they have safely reached userspace;
+ * both under r->read_lock.
+ */
+int lunix_events_peek(struct lunix_events_reader_struct *r,
+	struct lunix_event_struct *ev, int max)
+{
+	unsigned long flags;
+	int i, n;
+
+	spin_lock_irqsave(&lunix_events_lock, flags);
+	n = CIRC_CNT(r->head, r->tail, LUNIX_EVENTS_RING);
+	if (n > max)
+		n = max;
+	for (i = 0; i < n; i++)
+		ev[i] = r->ring[(r->tail + i) & (LUNIX_EVENTS_RING - 1)];
+	spin_unlock_irqrestore(&lunix_events_lock, flags);
+
+	return n;
+}
+
+void lunix_events_consume(struct lunix_events_reader_struct *r, int n)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&lunix_events_lock, flags);
+	r->tail = (r->tail + n) & (LUNIX_EVENTS_RING - 1);
+	spin_unlock_irqrestore(&lunix_events_lock, flags);
+}
+
+/*
+ * Appends an update of sensor number sensor to every reader's ring.
+ * Called from lunix_sensor_publish(), with the sensor lock held.
+ */
+void lunix_events_post(unsigned int sensor, uint64_t seq, uint64_t now,
+	uint16_t batt, uint16_t temp, uint16_t light)
+{
+	struct lunix_events_reader_struct *r;
+	struct lunix_event_struct *ev;
+	unsigned long flags;
+	int was_empty;
+
+	/* Nobody is listening, the common case */
+	if (list_empty(&lunix_events_readers))
+		return;
+
+	spin_lock_irqsave(&lunix_events_lock, flags);
+	list_for_each_entry(r, &lunix_events_readers, list) {
+		if (!CIRC_SPACE(r->head, r->tail, LUNIX_EVENTS_RING)) {
+			r->overruns++;
+			continue;
+		}
+
+		ev = &r->ring[r->head];
+		ev->timestamp = now;
+		ev->seq = seq;
+		ev->sensor = sensor;
+		ev->overruns = r->overruns;
+		ev->raw[BATT] = batt;
+		ev->raw[TEMP] = temp;
+		ev->raw[LIGHT] = light;
+		ev->reserved = 0;
+
+		was_empty = r->head == r->tail;
+		r->head = (r->head + 1) & (LUNIX_EVENTS_RING - 1);
+
+		/* Readers only sleep on an empty ring */
+		if (was_empty)
+			wake_up_interruptible(&r->wq);
+	}
+	spin_unlock_irqrestore(&lunix_events_lock, flags);
+}
@@ -0,0 +1,75 @@
+/*
+ * lunix-events.h
+ *
+ * Definition file for the Lunix:TNG event stream,
+ * every sensor update in arrival order [/dev/lunix-events]
+ *
+ */
+
+#ifndef _LUNIX_EVENTS_H
+#define _LUNIX_EVENTS_H
+
+#include "lunix.h"
+
+/*
+ * A read() on /dev/lunix-events returns an integral number of these
+ */
+struct lunix_event_struct {
+	uint64_t timestamp;		/* CLOCK_MONOTONIC, in ns */
+	uint64_t seq;			/* Sample number, for this sensor */
+	uint32_t sensor;		/* Sensor number [node id - 1] */
+	uint32_t overruns;		/* Events this reader lost so far */
+	uint16_t raw[3];		/* Battery, temperature, light */
+	uint16_t reserved;
+};
+
+/* Compile-time parameters */
+#define LUNIX_EVENTS_RING	4096	/* Events queued per reader, must be a power of 2 */
+
+#ifdef __KERNEL__
+
+#include <linux/list.h>
+#include <linux/wait.h>
+#include <linux/mutex.h>
+
+/*
+ * Every open /dev/lunix-events file is a reader with its own ring.
+ * lunix_sensor_publish() appends to the rings of all readers; when a
+ * ring is full the new event is dropped and counted in overruns.
+ */
+struct lunix_events_reader_struct {
+	struct list_head list;
+
+	/* Protected by lunix_events_lock */
+	unsigned int head, tail;
+	uint32_t overruns;
+	struct lunix_event_struct *ring;
+
+	/* Woken up when the ring stops being empty */
+	wait_queue_head_t wq;
+
+	/*
+	 * Held by read() across lunix_events_peek(), the copy to
+	 * userspace and lunix_events_consume(), so that threads
+	 * sharing the file neither duplicate nor skip events
+	 */
+	struct mutex read_lock;
+};
+
+/*
+ * Function prototypes
+ */
+struct lunix_events_reader_struct *lunix_events_open(void);
+void lunix_events_close(struct lunix_events_reader_struct *r);
+int lunix_events_pending(struct lunix_events_reader_struct *r);
+int lunix_events_fetch(struct lunix_events_reader_struct *r,
+	struct lunix_event_struct *ev, int max);
+int lunix_events_peek(struct lunix_events_reader_struct *r,
+	struct lunix_event_struct *ev, int max);
+void lunix_events_consume(struct lunix_events_reader_struct *r, int n);
+void lunix_events_post(unsigned int sensor, uint64_t seq, uint64_t now,
+	uint16_t batt, uint16_t temp, uint16_t light);
+
+#endif	/* __KERNEL__ */
+
+#endif	/* _LUNIX_EVENTS_H */
@@ -0,0 +1,105 @@
+/*
+ * lunix-format.h
+ *
+ * Fixed-point formatting of Lunix:TNG values in thousandths, for
+ * text mode reads. Shared with userspace, where mk_lookup_tables -c
+ * checks it against printf and -b times it.
+ *
+ */
+
+#ifndef _LUNIX_FORMAT_H
+#define _LUNIX_FORMAT_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/bitops.h>
+#include <linux/string.h>
+#define lunix_format_fls(x)	fls(x)
+#else
+#include <stdint.h>
+#include <string.h>
+#define lunix_format_fls(x)	(32 - __builtin_clz(x))	/* x != 0 */
+#ifndef __always_inline
+#define __always_inline		inline __attribute__((always_inline))
+#endif
+#endif
+
+/*
+ * Two digits at a time
+ */
+static const char lunix_digit_pairs[200] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+static const uint32_t lunix_pow10[10] = {
+	1, 10, 100, 1000, 10000, 100000,
+	1000000, 10000000, 100000000, 1000000000
+};
+
+/*
+ * Writes value [in thousandths] to buf as text with the given number of
+ * decimals, rounded, and a newline; returns the number of characters
+ * written, at most 16. decimals is a constant in every caller, so the
+ * divisions below are strength-reduced; apart from the loop over pairs
+ * of integer digits nothing depends on the value.
+ */
+static __always_inline int lunix_format_fixed(unsigned char *buf, int32_t value,
+	const int decimals)
+{
+	const uint32_t div = lunix_pow10[3 - decimals];
+	uint32_t mask, scaled, ip, fp, nd, t;
+	unsigned char *p, *end;
+
+	/* Magnitude, rounded to the requested precision */
+	mask = -(uint32_t)(value < 0);
+	scaled = ((((uint32_t)value ^ mask) - mask) + div / 2) / div;
+	ip = scaled / lunix_pow10[decimals];
+	fp = scaled % lunix_pow10[decimals];
+
+	/* A sign, unless the value rounds to zero */
+	buf[0] = '-';
+	p = buf + (mask & (scaled != 0));
+
+	/* Number of integer digits, from the position of the top bit */
+	t = (lunix_format_fls(ip | 1) * 1233) >> 12;
+	nd = t + ((ip | 1) >= lunix_pow10[t]);
+
+	/* Integer digits, right to left */
+	end = p + nd;
+	for (p = end; ip >= 100; ip /= 100) {
+		p -= 2;
+		memcpy(p, &lunix_digit_pairs[2 * (ip % 100)], 2);
+	}
+	if (ip >= 10)
+		memcpy(p - 2, &lunix_digit_pairs[2 * ip], 2);
+	else
+		p[-1] = '0' + ip;
+	p = end;
+
+	if (decimals == 3) {
+		*p++ = '.';
+		memcpy(p, &lunix_digit_pairs[2 * (fp / 10)], 2);
+		p[2] = '0' + fp % 10;
+		p += 3;
+	} else if (decimals == 2) {
+		*p++ = '.';
+		memcpy(p, &lunix_digit_pairs[2 * fp], 2);
+		p += 2;
+	} else if (decimals == 1) {
+		*p++ = '.';
+		*p++ = '0' + fp;
+	}
+	*p++ = '\n';
+
+	return p - buf;
+}
+
+#endif	/* _LUNIX_FORMAT_H */
@@ -13,37 +13,196 @@
 #include <linux/serio.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
+#include <linux/vmalloc.h>
+#include <linux/spinlock.h>
+#include <linux/circ_buf.h>
+#include <linux/workqueue.h>
 
 #include <asm/atomic.h>
 #include <asm/uaccess.h>
 
 #include "lunix.h"
+#include "lunix-chrdev.h"
 #include "lunix-ldisc.h"
 #include "lunix-protocol.h"
 
 /*
- * This line discipline can only be associated
- * with a single TTY at any time.
+ * This line discipline can be associated with up to
+ * LUNIX_LDISC_MAX_TTYS TTYs [base stations] at any time.
  */
 static atomic_t lunix_disc_available;
 
+/*
+ * In deferred mode [lunix_ldisc_deferred], lunix_ldisc_receive() only
+ * copies incoming bytes into a single-producer/single-consumer ring.
+ * The protocol code runs later, from a work item on lunix_ldisc_wq,
+ * so the cost of parsing and sensor updates never shows up in the
+ * TTY receive path. No locks are needed between the two sides, see
+ * Documentation/circular-buffers.txt for the barriers.
+ */
+#define LUNIX_LDISC_RING_SIZE	65536	/* Must be a power of 2 */
+
+/*
+ * Per-TTY state, hanging off tty->disc_data. Every TTY has its own
+ * parser [and ring and work item], so TTYs are processed in parallel
+ * on different CPUs. They only meet at the sensors they update,
+ * which are protected by the per-sensor locks.
+ */
+struct lunix_ldisc_struct {
+	struct list_head list;		/* In lunix_ldisc_list */
+	struct lunix_protocol_state_struct proto;
+
+	unsigned char *ring;
+	unsigned int head;		/* Only written by the producer */
+	unsigned int tail;		/* Only written by the consumer */
+	struct work_struct work;
+
+	unsigned long rx_overruns;	/* Bytes dropped, ring was full */
+};
+
+static struct workqueue_struct *lunix_ldisc_wq;
+
+/*
+ * Attached TTYs, and the counters of those already closed, for
+ * LUNIX_IOC_GET_STATS. The counters themselves are only written by
+ * the receive path [or the work item] of their own TTY, and read
+ * without stopping it.
+ */
+static LIST_HEAD(lunix_ldisc_list);
+static DEFINE_SPINLOCK(lunix_ldisc_lock);
+static struct lunix_stats_struct lunix_ldisc_closed;
+
+static void lunix_ldisc_add_stats(struct lunix_stats_struct *st,
+	struct lunix_ldisc_struct *ld)
+{
+	st->rx_packets += ACCESS_ONCE(ld->proto.rx_packets);
+	st->rx_crc_errors += ACCESS_ONCE(ld->proto.rx_crc_errors);
+	st->rx_resyncs += ACCESS_ONCE(ld->proto.rx_resyncs);
+	st->rx_skipped += ACCESS_ONCE(ld->proto.rx_skipped);
+	st->rx_coalesced += ACCESS_ONCE(ld->proto.rx_coalesced);
+	st->rx_overruns += ACCESS_ONCE(ld->rx_overruns);
+	st->rx_nomem += ACCESS_ONCE(ld->proto.rx_nomem);
+}
+
+void lunix_ldisc_get_stats(struct lunix_stats_struct *st)
+{
+	struct lunix_ldisc_struct *ld;
+
+	spin_lock(&lunix_ldisc_lock);
+	*st = lunix_ldisc_closed;
+	list_for_each_entry(ld, &lunix_ldisc_list, list) {
+		st->ttys++;
+		lunix_ldisc_add_stats(st, ld);
+	}
+	spin_unlock(&lunix_ldisc_lock);
+}
+
+/*
+ * Producer side, runs in the TTY receive path
+ */
+static void lunix_ldisc_enqueue(struct lunix_ldisc_struct *ld,
+	const unsigned char *cp, int count)
+{
+	unsigned int head = ld->head;
+	unsigned int tail = ACCESS_ONCE(ld->tail);
+	int space, n;
+
+	space = CIRC_SPACE(head, tail, LUNIX_LDISC_RING_SIZE);
+	if (count > space) {
+		/* The parser will resync on whatever follows */
+		if (printk_ratelimit())
+			printk(KERN_WARNING "lunix: ring full, dropping %d bytes\n",
+				count - space);
+		ld->rx_overruns += count - space;
+		count = space;
+	}
+
+	while (count > 0) {
+		n = min_t(int, count, LUNIX_LDISC_RING_SIZE - head);
+		memcpy(&ld->ring[head], cp, n);
+		head = (head + n) & (LUNIX_LDISC_RING_SIZE - 1);
+		cp += n;
+		count -= n;
+	}
+
+	/* Commit the data before publishing the new head */
+	smp_wmb();
+	ld->head = head;
+
+	queue_work(lunix_ldisc_wq, &ld->work);
+}
+
+/*
+ * Consumer side, feeds everything in the ring to the protocol code
+ */
+static void lunix_ldisc_work(struct work_struct *work)
+{
+	struct lunix_ldisc_struct *ld;
+	unsigned int head, tail;
+	int n;
+
+	ld = container_of(work, struct lunix_ldisc_struct, work);
+	for (;;) {
+		head = ACCESS_ONCE(ld->head);
+		tail = ld->tail;
+		n = CIRC_CNT_TO_END(head, tail, LUNIX_LDISC_RING_SIZE);
+		if (!n)
+			break;
+
+		/* Read the index before the contents it covers */
+		smp_rmb();
+		lunix_protocol_received_buf(&ld->proto, &ld->ring[tail], n);
+
+		/* Finish reading before the producer may reuse the space */
+		smp_mb();
+		ld->tail = (tail + n) & (LUNIX_LDISC_RING_SIZE - 1);
+	}
+}
+
 /*
  * This function runs when the userspace helper
  * sets the Lunix:TNG line discipline on a TTY.
  */
 static int lunix_ldisc_open(struct tty_struct *tty)
 {
+	struct lunix_ldisc_struct *ld;
+	int ret;
+
 	if (!capable(CAP_SYS_ADMIN))
 		return -EPERM;
 	
-	/* Can only be associated with a single TTY */
+	/* Can only be associated with a limited number of TTYs */
 	if ( !atomic_add_unless(&lunix_disc_available, -1, 0))
 		return -EBUSY;
 
+	ret = -ENOMEM;
+	ld = kzalloc(sizeof(*ld), GFP_KERNEL);
+	if (!ld)
+		goto out;
+	lunix_protocol_init(&ld->proto);
+
+	if (lunix_ldisc_deferred) {
+		ld->ring = vmalloc(LUNIX_LDISC_RING_SIZE);
+		if (!ld->ring)
+			goto out_with_ld;
+		INIT_WORK(&ld->work, lunix_ldisc_work);
+	}
+
+	tty->disc_data = ld;
 	tty->receive_room = 65536; /* No flow control, FIXME */
 
+	spin_lock(&lunix_ldisc_lock);
+	list_add_tail(&ld->list, &lunix_ldisc_list);
+	spin_unlock(&lunix_ldisc_lock);
+
 	debug("lunix ldisc associated with TTY %s\n", tty->name);
 	return 0;
+
+out_with_ld:
+	kfree(ld);
+out:
+	atomic_inc(&lunix_disc_available);
+	return ret;
 }
 
 /*
@@ -53,6 +212,27 @@ static int lunix_ldisc_open(struct tty_struct *tty)
 
 static void lunix_ldisc_close(struct tty_struct *tty)
 {
+	struct lunix_ldisc_struct *ld = tty->disc_data;
+
+	if (lunix_ldisc_deferred) {
+		/* No more data will arrive, drain what is left */
+		flush_work(&ld->work);
+		vfree(ld->ring);
+	}
+
+	printk(KERN_INFO "lunix: TTY %s: %lu packets, %lu CRC errors, %lu resyncs, "
+		"%lu coalesced updates, %lu bytes overrun, %lu dropped for lack of memory\n",
+		tty->name, ld->proto.rx_packets, ld->proto.rx_crc_errors, ld->proto.rx_resyncs,
+		ld->proto.rx_coalesced, ld->rx_overruns, ld->proto.rx_nomem);
+
+	spin_lock(&lunix_ldisc_lock);
+	list_del(&ld->list);
+	lunix_ldisc_add_stats(&lunix_ldisc_closed, ld);
+	spin_unlock(&lunix_ldisc_lock);
+
+	tty->disc_data = NULL;
+	kfree(ld);
+
 	atomic_inc(&lunix_disc_available);
 	/* FIXME */
 	/* Shouldn't we wake up all sleepers in all sensors here? */
@@ -67,6 +247,8 @@ static void lunix_ldisc_close(struct tty_struct *tty)
 static void lunix_ldisc_receive(struct tty_struct *tty,
 	const unsigned char *cp, char *fp, int count)
 {
+	struct lunix_ldisc_struct *ld = tty->disc_data;
+
 #if 1
 #if LUNIX_DEBUG
 	int i;
@@ -76,13 +258,17 @@ static void lunix_ldisc_receive(struct tty_struct *tty,
 		printk("0x%02x%s", cp[i], (i == count - 1) ? "" : ", ");
 	printk(" }\n");
 #endif
-	printk(KERN_INFO "lunix_ldisc_receive called\n");
+	debug("lunix_ldisc_receive called\n");
 #endif
 	/*
 	 * Pass incoming characters to protocol processing code,
-	 * which handle any necessary sensor updates.
+	 * which handle any necessary sensor updates, either right
+	 * away or through the ring.
 	 */
-	lunix_protocol_received_buf(&lunix_protocol_state, cp, count);
+	if (lunix_ldisc_deferred)
+		lunix_ldisc_enqueue(ld, cp, count);
+	else
+		lunix_protocol_received_buf(&ld->proto, cp, count);
 	//debug("passed incoming bytes to state machine, leaving\n");
 }
 
@@ -112,7 +298,7 @@ static ssize_t lunix_ldisc_write(struct tty_struct * tty, struct file * file,
 
 static struct tty_ldisc_ops lunix_ldisc_ops = {
 	.owner =	THIS_MODULE,
-	.name =		"lunix"
+	.name =		"lunix",
 	.open =		lunix_ldisc_open,
 	.close =	lunix_ldisc_close,
 	.read =		lunix_ldisc_read,
@@ -125,11 +311,24 @@ int lunix_ldisc_init(void)
 	int ret;
 
 	debug("initializing lunix ldisc\n");
-	atomic_set(&lunix_disc_available, 1);
+	atomic_set(&lunix_disc_available, LUNIX_LDISC_MAX_TTYS);
+
+	if (lunix_ldisc_deferred) {
+		lunix_ldisc_wq = alloc_workqueue("lunix", WQ_UNBOUND, 0);
+		if (!lunix_ldisc_wq) {
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
+
 	ret = tty_register_ldisc(N_LUNIX_LDISC, &lunix_ldisc_ops);
-	if (ret)
+	if (ret) {
 		printk(KERN_ERR "%s: Error registering line discipline, ret = %d.\n", __FILE__, ret);
+		if (lunix_ldisc_wq)
+			destroy_workqueue(lunix_ldisc_wq);
+	}
 	
+out:
 	debug("leaving with ret = %d\n", ret);
 	return ret;
 }
@@ -138,6 +337,8 @@ void lunix_ldisc_destroy(void)
 {
 	debug("unregistering lunix ldisc\n");
 	tty_unregister_ldisc(N_LUNIX_LDISC);
+	if (lunix_ldisc_wq)
+		destroy_workqueue(lunix_ldisc_wq);
 	debug("lunix ldisc unregistered\n");
 }
 
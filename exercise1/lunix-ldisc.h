@@ -12,14 +12,23 @@
 #define _LUNIX_LDISC_H
 
 /* Compile-time parameters */
+#define LUNIX_LDISC_MAX_TTYS	8	/* Base stations attached at the same time */
 
 #ifdef __KERNEL__ 
 
+/*
+ * Run the protocol code from a workqueue instead of the TTY receive path
+ */
+extern int lunix_ldisc_deferred;
+
 /*
  * Function prototypes
  */
+struct lunix_stats_struct;
+
 int lunix_ldisc_init(void);
 void lunix_ldisc_destroy(void);
+void lunix_ldisc_get_stats(struct lunix_stats_struct *st);
 
 #endif	/* __KERNEL__ */
 
@@ -20,8 +20,7 @@
  * Global state for Lunix:TNG sensors
  */
 int lunix_sensor_cnt = LUNIX_SENSOR_CNT;
-struct lunix_sensor_struct *lunix_sensors;
-struct lunix_protocol_state_struct lunix_protocol_state;
+int lunix_ldisc_deferred = 0;
 
 /*
  * Module init and cleanup functions
@@ -30,37 +29,31 @@ struct lunix_protocol_state_struct lunix_protocol_state;
 int __init lunix_module_init(void)
 {
 	int ret;
-	int si_done;
 
 	printk(KERN_INFO "Initializing the Lunix:TNG module [max %d sensors]\n",
 		lunix_sensor_cnt);
 
-	ret = -ENOMEM;
-	lunix_sensors = kzalloc(sizeof(*lunix_sensors) * lunix_sensor_cnt, GFP_KERNEL);
-	if (!lunix_sensors) {
-		printk(KERN_ERR "Failed to allocate memory for Lunix sensors\n");
+	ret = -EINVAL;
+	if (lunix_sensor_cnt <= 0 || lunix_sensor_cnt > LUNIX_SENSOR_MAX) {
+		printk(KERN_ERR "Lunix:TNG supports 1 to %d sensors\n", LUNIX_SENSOR_MAX);
 		goto out;
 	}
-	lunix_protocol_init(&lunix_protocol_state);
+	lunix_protocol_crc_init();
 
 	/*
-	 * Initialize all sensors. On exit, si_done is the index of the last
-	 * successfully initialized sensor.
+	 * Sensors are allocated on first use, only the region
+	 * with the latest values of all of them is needed up front
 	 */
-	for (si_done = -1; si_done < lunix_sensor_cnt - 1; si_done++) {
-		debug("initializing sensor %d\n", si_done + 1);
-		ret = lunix_sensor_init(&lunix_sensors[si_done + 1]);
-		debug("initialized sensor %d, ret = %d\n", si_done + 1, ret);
-		if (ret < 0) {
-			goto out_with_sensors;
-		}
+	if ((ret = lunix_all_init()) < 0) {
+		printk(KERN_ERR "Failed to allocate memory for Lunix sensors\n");
+		goto out;
 	}
 
 	/*
 	 * Initialize the Lunix line discipline
 	 */
 	if ((ret = lunix_ldisc_init()) < 0)
-		goto out_with_sensors;
+		goto out_with_all;
 
 	/*
 	 * Initialize the Lunix character device
@@ -78,11 +71,9 @@ out_with_ldisc:
 	debug("at out_with_ldisc\n");
 	lunix_ldisc_destroy();
 
-out_with_sensors:
-	debug("at out_with_sensors\n");
-	for (; si_done >= 0; si_done--)
-		lunix_sensor_destroy(&lunix_sensors[si_done]);
-	kfree(lunix_sensors);
+out_with_all:
+	debug("at out_with_all\n");
+	lunix_all_destroy();
 
 out:
 	debug("at out\n");
@@ -91,16 +82,13 @@ out:
 
 void __exit lunix_module_cleanup(void)
 {
-	int si_done;
-	
 	debug("entering, destroying chrdev and ldisc\n");
 	lunix_chrdev_destroy();
 	lunix_ldisc_destroy();
 	
 	debug("destroying sensor buffers\n");
-	for (si_done = lunix_sensor_cnt - 1; si_done >= 0; si_done--)
-		lunix_sensor_destroy(&lunix_sensors[si_done]);
-	kfree(lunix_sensors);
+	lunix_sensors_destroy();
+	lunix_all_destroy();
 
 	printk(KERN_INFO "Lunix:TNG module unloaded successfully\n");
 }
@@ -116,6 +104,9 @@ MODULE_LICENSE("GPL");
 module_param(lunix_sensor_cnt, int, 0);
 MODULE_PARM_DESC(lunix_sensor_cnt, "Maximum number of sensors to support");
 
+module_param(lunix_ldisc_deferred, int, 0);
+MODULE_PARM_DESC(lunix_ldisc_deferred, "Parse incoming data from a workqueue, not the TTY receive path");
+
 module_init(lunix_module_init);
 module_exit(lunix_module_cleanup);
 
@@ -19,6 +19,7 @@
 
 #include "lunix.h"
 #include "lunix-protocol.h"
+#include "lunix-scan.h"
 
 /*
  * Returns an unsigned 16-bit integer in native byte-order from 
@@ -32,6 +33,53 @@ static uint16_t uint16_from_packet(unsigned char *p)
 	return le16_to_cpu(le);
 }
 
+/*
+ * CRC-CCITT (polynomial 0x1021, initial value 0, MSB first), computed
+ * by the gateway over all bytes between the start byte and the CRC,
+ * and transmitted little-endian.
+ *
+ * lunix_crc_table[k][b] holds the CRC of byte b followed by k zero
+ * bytes, so that eight bytes can be folded in with eight independent
+ * lookups ("slice-by-8").
+ */
+static uint16_t lunix_crc_table[8][256];
+
+void lunix_protocol_crc_init(void)
+{
+	int b, k;
+	uint16_t crc;
+
+	for (b = 0; b < 256; b++) {
+		crc = b << 8;
+		for (k = 0; k < 8; k++)
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+		lunix_crc_table[0][b] = crc;
+	}
+	for (k = 1; k < 8; k++)
+		for (b = 0; b < 256; b++) {
+			crc = lunix_crc_table[k - 1][b];
+			lunix_crc_table[k][b] = (crc << 8) ^ lunix_crc_table[0][crc >> 8];
+		}
+}
+
+static inline uint16_t lunix_crc_byte(uint16_t crc, unsigned char c)
+{
+	return (crc << 8) ^ lunix_crc_table[0][(crc >> 8) ^ c];
+}
+
+static uint16_t lunix_crc_update(uint16_t crc, const unsigned char *p, int len)
+{
+	for (; len >= 8; len -= 8, p += 8)
+		crc = lunix_crc_table[7][(crc >> 8) ^ p[0]] ^
+		      lunix_crc_table[6][(crc & 0xFF) ^ p[1]] ^
+		      lunix_crc_table[5][p[2]] ^ lunix_crc_table[4][p[3]] ^
+		      lunix_crc_table[3][p[4]] ^ lunix_crc_table[2][p[5]] ^
+		      lunix_crc_table[1][p[6]] ^ lunix_crc_table[0][p[7]];
+	for (; len > 0; len--, p++)
+		crc = lunix_crc_byte(crc, *p);
+	return crc;
+}
+
 /*
  * Will display the contents of an incoming XMesh packet
  * that have been received so far
@@ -48,14 +96,50 @@ static inline void lunix_protocol_show_packet(struct lunix_protocol_state_struct
 #endif
 }
 
+/*
+ * New samples are appended to the sensor history as soon as each packet
+ * arrives, so none are lost, but sleepers are not woken up right away.
+ * Touched sensors are collected in a per-state batch and woken up
+ * together when the received buffer has been consumed [or the batch
+ * fills up], so every sensor is woken up only once per
+ * lunix_protocol_received_buf() call.
+ */
+static void lunix_protocol_batch_flush(struct lunix_protocol_state_struct *state)
+{
+	int i;
+
+	for (i = 0; i < state->batch_cnt; i++)
+		lunix_sensor_wake_up(state->batch[i]);
+	state->batch_cnt = 0;
+}
+
+static void lunix_protocol_batch_add(struct lunix_protocol_state_struct *state,
+	struct lunix_sensor_struct *s, uint16_t batt, uint16_t temp, uint16_t light)
+{
+	int i;
+
+	lunix_sensor_publish(s, batt, temp, light);
+
+	for (i = 0; i < state->batch_cnt; i++)
+		if (state->batch[i] == s) {
+			++state->rx_coalesced;
+			return;
+		}
+
+	if (state->batch_cnt == LUNIX_PROTOCOL_BATCH)
+		lunix_protocol_batch_flush(state);
+	state->batch[state->batch_cnt++] = s;
+}
+
 /*
  * Receives a complete XMesh packet and updates the node structures if
  * the packet contains sensor information. The function ignores other
  * types of packets. In future releases check packets with packet[4]
  * equal to 0x03, 0xFD for extending this function.
  */
-static void lunix_protocol_update_sensors(struct lunix_protocol_state_struct *state, struct lunix_sensor_struct *lunix_sensors)
+static void lunix_protocol_update_sensors(struct lunix_protocol_state_struct *state)
 {
+	struct lunix_sensor_struct *s;
 	uint16_t batt;
 	uint16_t temp;
 	uint16_t light;
@@ -74,9 +158,13 @@ static void lunix_protocol_update_sensors(struct lunix_protocol_state_struct *st
 		//debug ("I have the following raw data from nodeid = %d: { batt, temp, light } = { 0x%04x, 0x%04x, 0x%04x }\n",
 		//	nodeid, batt, temp, light);
 
-		if (nodeid > 0 && nodeid <= lunix_sensor_cnt)
-			lunix_sensor_update(&lunix_sensors[nodeid - 1], batt, temp, light);
-		else
+		if (nodeid > 0 && nodeid <= lunix_sensor_cnt) {
+			s = lunix_sensor_get(nodeid - 1, GFP_ATOMIC);
+			if (s)
+				lunix_protocol_batch_add(state, s, batt, temp, light);
+			else
+				++state->rx_nomem;
+		} else
 			printk(KERN_WARNING "Node id %d is out of bounds [maximum %d sensors]\n",
 				nodeid, lunix_sensor_cnt);
 	}
@@ -96,6 +184,32 @@ static void lunix_protocol_update_sensors(struct lunix_protocol_state_struct *st
  * (7 + PL + 2)			0X7E		Packet End byte signature
  **********************************************************************************/
 
+
+/*
+ * The protocol state machine, one entry per state. Every state reads a
+ * fixed number of bytes, except for SEEKING_PAYLOAD which reads as many
+ * as the payload length field says. Once a state has read all of its
+ * bytes, the machine advances to the next one; SEEKING_END_BYTE wraps
+ * around to SEEKING_START_BYTE.
+ */
+#define BTR_PAYLOAD_LENGTH	-1
+
+static const struct {
+	int bytes_to_read;	/* Bytes to read, or BTR_PAYLOAD_LENGTH */
+	int use_specials;	/* Unescape 0x7D / 0x7E sequences */
+	int use_crc;		/* Bytes are covered by the packet CRC */
+} lunix_protocol_fsm[] = {
+	[SEEKING_START_BYTE]          = { 1,                  0, 0 },
+	[SEEKING_PACKET_TYPE]         = { 1,                  0, 1 },
+	[SEEKING_DESTINATION_ADDRESS] = { 2,                  1, 1 },
+	[SEEKING_AM_TYPE]             = { 1,                  1, 1 },
+	[SEEKING_AM_GROUP]            = { 1,                  1, 1 },
+	[SEEKING_PAYLOAD_LENGTH]      = { 1,                  1, 1 },
+	[SEEKING_PAYLOAD]             = { BTR_PAYLOAD_LENGTH, 1, 1 },
+	[SEEKING_CRC]                 = { 2,                  1, 0 },
+	[SEEKING_END_BYTE]            = { 1,                  0, 0 },
+};
+
 /*
  * Helper function to quickly set the current state
  */
@@ -116,150 +230,209 @@ void lunix_protocol_init(struct lunix_protocol_state_struct *state)
 {
 	state->pos = 0;
 	state->next_is_special = 0;
+	state->payload_length = 0;
+	state->crc = 0;
+	state->rx_packets = 0;
+	state->rx_crc_errors = 0;
+	state->rx_resyncs = 0;
+	state->rx_skipped = 0;
+	state->rx_coalesced = 0;
+	state->rx_nomem = 0;
+	state->batch_cnt = 0;
 	set_state(state, SEEKING_START_BYTE, 1, 0);
 }
 
+/*
+ * Abandons the packet being received after a framing error.
+ * The state machine goes back to looking for a start byte,
+ * so at most the bytes up to the next 0x7E are lost.
+ */
+static void lunix_protocol_resync(struct lunix_protocol_state_struct *state)
+{
+	debug("framing error in state %d at pos %d, resyncing\n", state->state, state->pos);
+	++state->rx_resyncs;
+	state->pos = 0;
+	state->next_is_special = 0;
+	state->crc = 0;
+	set_state(state, SEEKING_START_BYTE, 1, 0);
+}
+
+/*
+ * Skips everything up to the next frame delimiter
+ */
+static void lunix_protocol_seek_start(struct lunix_protocol_state_struct *state,
+	const unsigned char *data, int length, int *i)
+{
+	const unsigned char *p;
+	int skip;
+
+	p = memchr(&data[*i], 0x7E, length - *i);
+	skip = p ? p - &data[*i] : length - *i;
+	state->rx_skipped += skip;
+	*i += skip;
+}
+
 /*
  * Crucial function for parsing the input packet according
  * to the current state.
  *
+ * Runs of ordinary bytes are located with lunix_scan_special() and
+ * copied to the packet buffer in one go, only special characters
+ * are handled one at a time. The packet CRC is updated with the
+ * unstuffed bytes as they are copied, while they are still hot.
+ *
  * struct lunix_protocol_state_struct *state: 
  * unsigned char *data: the data received
  * int length: the amount of bytes received
  * int *i: the pointer to the data received is updated when data are 
  *         transferred to the unparsed_packet array
- * int use_specials: if 1 special characters are treated acc
+ *
+ * Returns 1 when the current state has read all of its bytes,
+ * 0 if more data are needed, -1 on a framing error. An unexpected
+ * 0x7E is left unconsumed, as it starts the next packet.
  */
 static int lunix_protocol_parse_state(struct lunix_protocol_state_struct *state,
-	const unsigned char *data, int length, int *i, int use_specials)
+	const unsigned char *data, int length, int *i)
 {
-	int iter;
-
-	//debug("entering, for *i = %d, length = %d, state = %d, btr = %d, br = %d, next_is_special = %d\n",
-	//	*i, length, state->state, state->bytes_to_read, state->bytes_read, state->next_is_special);
+	int use_specials = lunix_protocol_fsm[state->state].use_specials;
+	int use_crc = lunix_protocol_fsm[state->state].use_crc;
+	int want, run;
 
-	iter = 0;
 	while ((*i < length) && (state->bytes_read < state->bytes_to_read))
 	{
-#if LUNIX_DEBUG
-		if (++iter == 50) {
-			debug("OOPS!\n");
-			return -1;
-		}
-#endif
+		/* At most this many bytes of input belong to the current state */
+		want = state->bytes_to_read - state->bytes_read;
+		if (want > length - *i)
+			want = length - *i;
+
 		/* Prevent buffer overflows */
-		if (state->pos == MAX_PACKET_LEN) {
-			printk(KERN_ERR "WARNING: state->pos == %d, MAX_PACKET_LEN is %d,"
+		if (state->pos + want > MAX_PACKET_LEN) {
+			debug("state->pos == %d, MAX_PACKET_LEN is %d, "
 				"packet buffer would overflow!\n", state->pos, MAX_PACKET_LEN);
-			printk(KERN_ERR "How will I ever resync with the input stream?\n");
-			state->pos = 0;
 			return -1;
 		}
 
-		if (1 == use_specials)
-		{
-			if (state->next_is_special)
-			{
-				if (0x7E == state->next_is_special)
-					state->packet[state->pos] = data[*i];
-				if (0x7D == state->next_is_special)
-					state->packet[state->pos] = data[*i]^0x20;
-				++state->pos;
-				++state->bytes_read;
-				++(*i);
-				state->next_is_special = 0;
-			}
-			else
-			{
-				if ((0x7E == data[*i]) || (0x7D == data[*i]))
-				{
-					state->next_is_special = data[*i];
-					++(*i);
-				} else {
-					state->packet[state->pos] = data[*i];
-					++state->pos;
-					++state->bytes_read;
-					++(*i);
-				}
-			}
-		}
-		else
-		{
-			state->packet[state->pos] = data[*i];
+		if (state->next_is_special) {
+			/* An escaped frame delimiter aborts the packet */
+			if (0x7E == data[*i])
+				return -1;
+			state->packet[state->pos] = data[*i] ^ 0x20;
+			if (use_crc)
+				state->crc = lunix_crc_byte(state->crc, state->packet[state->pos]);
 			++state->pos;
 			++state->bytes_read;
 			++(*i);
+			state->next_is_special = 0;
+			continue;
+		}
+
+		run = use_specials ? lunix_scan_special(&data[*i], want) : want;
+		memcpy(&state->packet[state->pos], &data[*i], run);
+		if (use_crc)
+			state->crc = lunix_crc_update(state->crc, &data[*i], run);
+		state->pos += run;
+		state->bytes_read += run;
+		*i += run;
+
+		if (run < want) {
+			/* A frame delimiter in the middle of a packet */
+			if (0x7E == data[*i])
+				return -1;
+			/* Stopped short at an escape, the next byte is escaped */
+			state->next_is_special = data[*i];
+			++(*i);
 		}
 	}
 
-	if (state->bytes_read == state->bytes_to_read) {
-		//debug("returning 1 from state = %d, btr = %d, br = %d, next_is_special = %d\n",
-		//	state->state, state->bytes_to_read, state->bytes_read, state->next_is_special);
-		return 1;
-	}	
+	return state->bytes_read == state->bytes_to_read;
+}
 
-	//debug("returning 0 from state = %d, btr = %d, br = %d, next_is_special = %d\n",
-	//	state->state, state->bytes_to_read, state->bytes_read, state->next_is_special);
+/*
+ * Called when the current state has read all of its bytes,
+ * moves the state machine to the next state.
+ * Returns -1 if the packet turns out to be malformed.
+ */
+static int lunix_protocol_next_state(struct lunix_protocol_state_struct *state)
+{
+	int next;
+	int btr;
+
+	switch (state->state) {
+	case SEEKING_PACKET_TYPE:
+		/*
+		 * Back-to-back delimiters, e.g. we got in sync on the
+		 * end byte of a packet: this one is the actual start byte,
+		 * and it must not stay in the CRC of the packet it starts.
+		 */
+		if (0x7E == state->packet[state->pos - 1]) {
+			--state->pos;
+			state->crc = 0;
+			set_state(state, SEEKING_PACKET_TYPE, 1, 0);
+			return 0;
+		}
+		break;
+	case SEEKING_PAYLOAD_LENGTH:
+		state->payload_length = state->packet[state->pos - 1];
+		/* Payload, CRC and end byte must fit in the packet buffer */
+		if (state->pos + state->payload_length + 3 > MAX_PACKET_LEN)
+			return -1;
+		break;
+	case SEEKING_END_BYTE:
+		if (0x7E != state->packet[state->pos - 1])
+			return -1;
+		/*
+		 * Drop corrupted packets before they get anywhere
+		 * near the sensor locks and their sleepers.
+		 */
+		if (state->crc == uint16_from_packet(&state->packet[state->pos - 3])) {
+			//debug("An XMesh packet has been received, updating sensors\n");
+			lunix_protocol_update_sensors(state);
+			++state->rx_packets;
+		} else {
+			debug("CRC error, computed 0x%04x, dropping packet\n", state->crc);
+			++state->rx_crc_errors;
+		}
+		state->pos = 0;
+		state->next_is_special = 0;
+		state->crc = 0;
+		break;
+	}
+
+	next = (state->state == SEEKING_END_BYTE) ? SEEKING_START_BYTE : state->state + 1;
+	btr = lunix_protocol_fsm[next].bytes_to_read;
+	if (btr == BTR_PAYLOAD_LENGTH)
+		btr = state->payload_length;
+	set_state(state, next, btr, 0);
 	return 0;
 }
 
 /*
  * This function gets called for incoming data
  * to update the protocol state machine.
+ * It consumes the whole buffer, which may contain
+ * any number of complete or partial packets.
  */
 
 int lunix_protocol_received_buf(struct lunix_protocol_state_struct *state,
 	const unsigned char *buf, int length)
 {
 	int i;
-	int payload_length;
+	int ret;
 
 	i = 0;
+	while (i < length) {
+		if (state->state == SEEKING_START_BYTE)
+			lunix_protocol_seek_start(state, buf, length, &i);
+
+		ret = lunix_protocol_parse_state(state, buf, length, &i);
+		if (ret == 0)
+			break;
+		if (ret < 0 || lunix_protocol_next_state(state) < 0)
+			lunix_protocol_resync(state);
+	}
 
-	if (state->state == SEEKING_START_BYTE) 
-		if (lunix_protocol_parse_state(state, buf, length, &i, 0) == 1)
-			set_state(state, SEEKING_PACKET_TYPE, 1, 0);
-
-
-	if (state->state == SEEKING_PACKET_TYPE) 
-		if (lunix_protocol_parse_state(state, buf, length, &i, 0) == 1)
-			set_state(state, SEEKING_DESTINATION_ADDRESS, 2, 0);
-
-	if (state->state == SEEKING_DESTINATION_ADDRESS) 
-		if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1)
-			set_state(state, SEEKING_AM_TYPE, 1, 0);
-
-	if (state->state == SEEKING_AM_TYPE) 
-		if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1)
-			set_state(state, SEEKING_AM_GROUP, 1, 0);
-
-	if (state->state == SEEKING_AM_GROUP) 
-		if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1)
-			set_state(state, SEEKING_PAYLOAD_LENGTH, 1, 0);
-
-	if (state->state == SEEKING_PAYLOAD_LENGTH) 
-		if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1) {
-			payload_length = state->packet[state->pos - 1];
-			set_state(state, SEEKING_PAYLOAD, payload_length, 0);
-		}
-
-	if (state->state == SEEKING_PAYLOAD) 
-		if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1)
-			set_state(state, SEEKING_CRC, 2, 0);
-
-	if (state->state == SEEKING_CRC) 
-		if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1)
-			set_state(state, SEEKING_END_BYTE, 1, 0);
-
-	if (state->state == SEEKING_END_BYTE) 
-		if (lunix_protocol_parse_state(state, buf, length, &i, 0) == 1) {
-			//debug("An XMesh packet has been received, updating sensors\n");
-
-			lunix_protocol_update_sensors(state, lunix_sensors);
-			state->pos = 0;
-			state->next_is_special = 0;
-			set_state(state, SEEKING_START_BYTE, 1, 0);
-		}
+	if (state->batch_cnt)
+		lunix_protocol_batch_flush(state);
 
 	//debug("leaving\n");
 
@@ -38,6 +38,12 @@
 #define SEEKING_CRC                    8
 #define SEEKING_END_BYTE               9
 
+/*
+ * Sensors updated while consuming a received buffer,
+ * woken up together once it has been consumed
+ */
+#define LUNIX_PROTOCOL_BATCH           16
+
 /*
  * Current state of the Lunix protocol state machine
  */
@@ -50,12 +56,24 @@ struct lunix_protocol_state_struct
 	int pos;                        /* Current pos in the XMesh Packet */
 	unsigned char next_is_special;  /* The next character to be received is a special character */
 	unsigned char payload_length;   /* The length of the payload of the received packet */
+	uint16_t crc;                   /* Running CRC of the packet being received */
 	unsigned char packet[MAX_PACKET_LEN]; /* The XMesh packet being received */
+
+	int batch_cnt;                  /* Sensors with pending wakeups */
+	struct lunix_sensor_struct *batch[LUNIX_PROTOCOL_BATCH];
+
+	unsigned long rx_packets;       /* Number of valid packets received */
+	unsigned long rx_crc_errors;    /* Number of packets dropped due to bad CRC */
+	unsigned long rx_resyncs;       /* Number of packets abandoned due to framing errors */
+	unsigned long rx_skipped;       /* Number of bytes skipped looking for a start byte */
+	unsigned long rx_coalesced;     /* Number of wakeups saved by batching */
+	unsigned long rx_nomem;         /* Number of packets dropped, no memory for a new sensor */
 };
 
 /*
  * Function prototypes
  */
+void lunix_protocol_crc_init(void);
 void lunix_protocol_init(struct lunix_protocol_state_struct *);
 int lunix_protocol_received_buf(struct lunix_protocol_state_struct *, const unsigned char *buf, int count);
 
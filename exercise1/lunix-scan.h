@@ -0,0 +1,136 @@
+/*
+ * lunix-scan.h
+ *
+ * Fast scanning for the special characters of the XMesh
+ * byte-stuffing scheme, 0x7D (escape) and 0x7E (frame delimiter).
+ *
+ * The kernel build scans a word at a time and never touches FPU/vector
+ * state: lunix_protocol_parse_state() scans at most one packet field
+ * per call (<= 255 bytes), far too little to amortize the cost of
+ * kernel_fpu_begin()/kernel_fpu_end(). Userspace builds on top of the
+ * shims (lunix-bench and friends) scan the same way by default, so that
+ * they time what the module runs; with LUNIX_SCAN_VECTOR defined they
+ * use SSE2/AVX2 instead, when the compiler targets them.
+ *
+ */
+
+#ifndef _LUNIX_SCAN_H
+#define _LUNIX_SCAN_H
+
+#include <linux/kernel.h>
+#include <linux/bitops.h>
+#include <asm/unaligned.h>
+
+#if defined(LUNIX_SHIM) && defined(LUNIX_SCAN_VECTOR) && defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+/*
+ * Byte-at-a-time scan, for short fields and tails
+ */
+static inline int lunix_scan_special_bytes(const unsigned char *data, int length)
+{
+	int i;
+
+	for (i = 0; i < length; i++)
+		if (data[i] == 0x7D || data[i] == 0x7E)
+			break;
+	return i;
+}
+
+/*
+ * Word-at-a-time scan. lunix_scan_zero_bytes() sets the high bit of
+ * exactly those bytes of v that are zero (no false positives from
+ * borrows), so the first match can be located from either end.
+ */
+#define LUNIX_SCAN_ONES		(~0UL / 0xFF)
+#define LUNIX_SCAN_LOW7		(LUNIX_SCAN_ONES * 0x7F)
+
+static inline unsigned long lunix_scan_zero_bytes(unsigned long v)
+{
+	return ~(((v & LUNIX_SCAN_LOW7) + LUNIX_SCAN_LOW7) | v | LUNIX_SCAN_LOW7);
+}
+
+static inline int lunix_scan_special_words(const unsigned char *data, int length)
+{
+	unsigned long w, m;
+	int i;
+
+	for (i = 0; i + (int)sizeof(w) <= length; i += sizeof(w)) {
+		w = get_unaligned((const unsigned long *)&data[i]);
+		m = lunix_scan_zero_bytes(w ^ (LUNIX_SCAN_ONES * 0x7D)) |
+		    lunix_scan_zero_bytes(w ^ (LUNIX_SCAN_ONES * 0x7E));
+		if (m) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+			return i + (__ffs(m) >> 3);
+#else
+			return i + ((BITS_PER_LONG - 1 - __fls(m)) >> 3);
+#endif
+		}
+	}
+	return i + lunix_scan_special_bytes(&data[i], length - i);
+}
+
+#if defined(LUNIX_SHIM) && defined(LUNIX_SCAN_VECTOR) && defined(__SSE2__)
+
+#ifdef __AVX2__
+#define LUNIX_SCAN_IMPL		"avx2 [userspace only]"
+#else
+#define LUNIX_SCAN_IMPL		"sse2 [userspace only]"
+#endif
+
+/*
+ * Vector scan, 32 or 16 bytes at a time
+ */
+static inline int lunix_scan_special_vector(const unsigned char *data, int length)
+{
+	const __m128i esc = _mm_set1_epi8(0x7D);
+	const __m128i sync = _mm_set1_epi8(0x7E);
+#ifdef __AVX2__
+	const __m256i esc32 = _mm256_set1_epi8(0x7D);
+	const __m256i sync32 = _mm256_set1_epi8(0x7E);
+#endif
+	unsigned int m;
+	int i = 0;
+
+#ifdef __AVX2__
+	for (; i + 32 <= length; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)&data[i]);
+		m = _mm256_movemask_epi8(_mm256_or_si256(
+			_mm256_cmpeq_epi8(v, esc32), _mm256_cmpeq_epi8(v, sync32)));
+		if (m)
+			return i + __builtin_ctz(m);
+	}
+#endif
+	for (; i + 16 <= length; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)&data[i]);
+		m = _mm_movemask_epi8(_mm_or_si128(
+			_mm_cmpeq_epi8(v, esc), _mm_cmpeq_epi8(v, sync)));
+		if (m)
+			return i + __builtin_ctz(m);
+	}
+	return i + lunix_scan_special_bytes(&data[i], length - i);
+}
+
+#define lunix_scan_special_long	lunix_scan_special_vector
+
+#else
+
+#define LUNIX_SCAN_IMPL		"word [as in the module]"
+#define lunix_scan_special_long	lunix_scan_special_words
+
+#endif
+
+/*
+ * Returns the offset of the first special character (0x7D or 0x7E)
+ * in data[0, length), or length if there is none.
+ */
+static inline int lunix_scan_special(const unsigned char *data, int length)
+{
+	/* Header fields are one or two bytes long */
+	if (length < (int)sizeof(unsigned long))
+		return lunix_scan_special_bytes(data, length);
+	return lunix_scan_special_long(data, length);
+}
+
+#endif	/* _LUNIX_SCAN_H */
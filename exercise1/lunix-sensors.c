@@ -17,18 +17,22 @@
 #include <linux/sched.h>
 #include <linux/ioctl.h>
 #include <linux/types.h>
+#include <linux/ktime.h>
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/mmzone.h>
 #include <linux/vmalloc.h>
 #include <linux/spinlock.h>
+#include <linux/rcupdate.h>
+#include <linux/radix-tree.h>
 
 #include "lunix.h"
+#include "lunix-events.h"
 
 /*
  * Initialization and destruction of sensor structures
  */
-int lunix_sensor_init(struct lunix_sensor_struct *s)
+int lunix_sensor_init(struct lunix_sensor_struct *s, gfp_t gfp)
 {
 	int i;
 	int ret;
@@ -39,15 +43,18 @@ int lunix_sensor_init(struct lunix_sensor_struct *s)
 	 */
 	spin_lock_init(&s->lock);
 	init_waitqueue_head(&s->wq);
+	INIT_LIST_HEAD(&s->watches);
+	spin_lock_init(&s->watch_lock);
 
 	/*
 	 * Allocate one page per measurement buffer
 	 */
+	BUILD_BUG_ON(sizeof(struct lunix_msr_data_struct) > PAGE_SIZE);
 	for (i = 0; i < N_LUNIX_MSR; i++)
 		s->msr_data[i] = NULL;
 
 	for (i = 0; i < N_LUNIX_MSR; i++) {
-		p = get_zeroed_page(GFP_KERNEL);
+		p = get_zeroed_page(gfp);
 		if (!p) {
 			ret = -ENOMEM;
 			goto out;
@@ -68,29 +75,259 @@ void lunix_sensor_destroy(struct lunix_sensor_struct *s)
 	for (i = 0; i < N_LUNIX_MSR; i++) {
 		if (s->msr_data[i])
 			free_page((unsigned long)s->msr_data[i]);
+		kfree(s->cache[i]);
 	}
+	kfree(s->calib);
 }
 
-void lunix_sensor_update(struct lunix_sensor_struct *s,
+/*
+ * The sensor table, a radix tree indexed by sensor number. A sensor
+ * is allocated on first use, i.e. when the first packet from its node
+ * arrives or when one of its device nodes is opened, and lives until
+ * the module is unloaded. Node ids that never show up cost nothing.
+ *
+ * Lookups are lockless, insertions are serialized
+ * by lunix_sensor_tree_lock.
+ */
+static RADIX_TREE(lunix_sensor_tree, GFP_ATOMIC);
+static DEFINE_SPINLOCK(lunix_sensor_tree_lock);
+
+struct lunix_sensor_struct *lunix_sensor_lookup(unsigned int id)
+{
+	struct lunix_sensor_struct *s;
+
+	rcu_read_lock();
+	s = radix_tree_lookup(&lunix_sensor_tree, id);
+	rcu_read_unlock();
+
+	return s;
+}
+
+/*
+ * Returns the sensor with the given number, allocating it if this is
+ * its first use, or NULL if the number is out of range or we are out
+ * of memory. Runs in the TTY receive path too, so callers there must
+ * pass GFP_ATOMIC.
+ */
+struct lunix_sensor_struct *lunix_sensor_get(unsigned int id, gfp_t gfp)
+{
+	struct lunix_sensor_struct *s, *old = NULL;
+	unsigned long flags;
+	int ret;
+
+	if (id >= lunix_sensor_cnt)
+		return NULL;
+
+	s = lunix_sensor_lookup(id);
+	if (likely(s))
+		return s;
+
+	s = kzalloc(sizeof(*s), gfp);
+	if (!s)
+		return NULL;
+	s->id = id;
+	if (lunix_sensor_init(s, gfp) < 0)
+		goto out_with_sensor;
+
+	spin_lock_irqsave(&lunix_sensor_tree_lock, flags);
+	ret = radix_tree_insert(&lunix_sensor_tree, id, s);
+	if (ret == -EEXIST)
+		old = radix_tree_lookup(&lunix_sensor_tree, id);
+	spin_unlock_irqrestore(&lunix_sensor_tree_lock, flags);
+
+	if (!ret) {
+		debug("allocated sensor %u\n", id);
+		return s;
+	}
+
+	/* Lost a race against another TTY or process, or out of memory */
+out_with_sensor:
+	lunix_sensor_destroy(s);
+	kfree(s);
+	return old;
+}
+
+/*
+ * Frees every sensor in the table. Only called on module
+ * unload, when nobody can be looking at them any more.
+ */
+void lunix_sensors_destroy(void)
+{
+	struct lunix_sensor_struct *batch[16];
+	unsigned int i, n;
+
+	while ((n = radix_tree_gang_lookup(&lunix_sensor_tree,
+			(void **)batch, 0, ARRAY_SIZE(batch))) > 0) {
+		for (i = 0; i < n; i++) {
+			radix_tree_delete(&lunix_sensor_tree, batch[i]->id);
+			lunix_sensor_destroy(batch[i]);
+			kfree(batch[i]);
+		}
+	}
+}
+
+/*
+ * The structure-of-arrays region behind /dev/lunix-all,
+ * allocated once at module load for every possible sensor.
+ */
+struct lunix_all_header_struct *lunix_all;
+
+#define LUNIX_ALL_ALIGN(x)	(((x) + 63) & ~63UL)
+
+int lunix_all_init(void)
+{
+	struct lunix_all_header_struct hdr;
+	unsigned long off, n = lunix_sensor_cnt;
+
+	hdr.magic = LUNIX_ALL_MAGIC;
+	hdr.nsensors = n;
+	off = LUNIX_ALL_ALIGN(sizeof(hdr));
+	hdr.seqcount_off = off;
+	off = LUNIX_ALL_ALIGN(off + n * sizeof(uint32_t));
+	hdr.seq_off = off;
+	off = LUNIX_ALL_ALIGN(off + n * sizeof(uint64_t));
+	hdr.timestamp_off = off;
+	off = LUNIX_ALL_ALIGN(off + n * sizeof(uint64_t));
+	hdr.batt_off = off;
+	off = LUNIX_ALL_ALIGN(off + n * sizeof(uint16_t));
+	hdr.temp_off = off;
+	off = LUNIX_ALL_ALIGN(off + n * sizeof(uint16_t));
+	hdr.light_off = off;
+	off = LUNIX_ALL_ALIGN(off + n * sizeof(uint16_t));
+	hdr.size = PAGE_ALIGN(off);
+	hdr.reserved = 0;
+
+	/* Zeroed, and fit for remap_vmalloc_range() */
+	lunix_all = vmalloc_user(hdr.size);
+	if (!lunix_all)
+		return -ENOMEM;
+	*lunix_all = hdr;
+
+	debug("%u bytes for %lu sensors\n", hdr.size, n);
+	return 0;
+}
+
+void lunix_all_destroy(void)
+{
+	vfree(lunix_all);
+	lunix_all = NULL;
+}
+
+/*
+ * Updates entry id of the region. Callers hold
+ * the sensor lock, so there is a single writer.
+ */
+static inline void lunix_all_publish(unsigned int id, uint64_t seq, uint64_t now,
+	uint16_t batt, uint16_t temp, uint16_t light)
+{
+	uint32_t *seqcount = lunix_all_array(lunix_all, seqcount);
+
+	seqcount[id]++;
+	smp_wmb();
+
+	((uint64_t *)lunix_all_array(lunix_all, seq))[id] = seq;
+	((uint64_t *)lunix_all_array(lunix_all, timestamp))[id] = now;
+	((uint16_t *)lunix_all_array(lunix_all, batt))[id] = batt;
+	((uint16_t *)lunix_all_array(lunix_all, temp))[id] = temp;
+	((uint16_t *)lunix_all_array(lunix_all, light))[id] = light;
+
+	smp_wmb();
+	seqcount[id]++;
+}
+
+/*
+ * Appends new raw measurements to the history of each
+ * measurement, without waking up anyone
+ */
+static inline void lunix_msr_append(struct lunix_msr_data_struct *msr,
+	uint16_t value, uint64_t now)
+{
+	struct lunix_msr_sample_struct *sample;
+	uint64_t seq = msr->seq + 1;
+
+	/* Make lockless readers back off and retry */
+	msr->seqcount++;
+	smp_wmb();
+
+	sample = lunix_msr_sample(msr, seq);
+	sample->seq = seq;
+	sample->timestamp = now;
+	sample->value = value;
+	msr->seq = seq;
+	msr->last_update = now;
+
+	smp_wmb();
+	msr->seqcount++;
+}
+
+/*
+ * Readers do not lock, so this never waits for them. The sensor
+ * lock only serializes TTYs that happen to update the same sensor.
+ */
+void lunix_sensor_publish(struct lunix_sensor_struct *s,
 	uint16_t batt, uint16_t temp, uint16_t light)
 {
+	uint64_t now = ktime_to_ns(ktime_get());
+
 	spin_lock(&s->lock);
 	
 	/*
 	 * Update the raw values and the relevant timestamps.
 	 */
-	s->msr_data[BATT]->values[0] = batt;
-	s->msr_data[TEMP]->values[0] = temp;
-	s->msr_data[LIGHT]->values[0] = light;
-
-	s->msr_data[BATT]->magic = s->msr_data[TEMP]->magic = s->msr_data[LIGHT]->magic = LUNIX_MSR_MAGIC;
-	s->msr_data[BATT]->last_update = s->msr_data[TEMP]->last_update = s->msr_data[LIGHT]->last_update = get_seconds();
+	lunix_msr_append(s->msr_data[BATT], batt, now);
+	lunix_msr_append(s->msr_data[TEMP], temp, now);
+	lunix_msr_append(s->msr_data[LIGHT], light, now);
+	lunix_all_publish(s->id, s->msr_data[BATT]->seq, now, batt, temp, light);
+	lunix_events_post(s->id, s->msr_data[BATT]->seq, now, batt, temp, light);
 	
 	spin_unlock(&s->lock);
+}
+
+/*
+ * Wakes up any sleepers who may be waiting on
+ * fresh data from this sensor, and those watchers
+ * who care about what it has just sent.
+ */
+void lunix_sensor_wake_up(struct lunix_sensor_struct *s)
+{
+	struct lunix_sensor_watch_struct *w;
+	unsigned long flags;
 
-	/*
-	 * And wake up any sleepers who may be waiting on
-	 * fresh data from this sensor.
-	 */
 	wake_up_interruptible(&s->wq);
+
+	/* Nobody is watching, the common case */
+	if (list_empty(&s->watches))
+		return;
+
+	spin_lock_irqsave(&s->watch_lock, flags);
+	list_for_each_entry(w, &s->watches, list)
+		if (w->fire(w, s))
+			wake_up_interruptible(&w->wq);
+	spin_unlock_irqrestore(&s->watch_lock, flags);
+}
+
+void lunix_sensor_watch(struct lunix_sensor_struct *s, struct lunix_sensor_watch_struct *w)
+{
+	unsigned long flags;
+
+	init_waitqueue_head(&w->wq);
+	spin_lock_irqsave(&s->watch_lock, flags);
+	list_add_tail(&w->list, &s->watches);
+	spin_unlock_irqrestore(&s->watch_lock, flags);
+}
+
+void lunix_sensor_unwatch(struct lunix_sensor_struct *s, struct lunix_sensor_watch_struct *w)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&s->watch_lock, flags);
+	list_del(&w->list);
+	spin_unlock_irqrestore(&s->watch_lock, flags);
+}
+
+void lunix_sensor_update(struct lunix_sensor_struct *s,
+	uint16_t batt, uint16_t temp, uint16_t light)
+{
+	lunix_sensor_publish(s, batt, temp, light);
+	lunix_sensor_wake_up(s);
 }
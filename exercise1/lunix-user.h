@@ -0,0 +1,307 @@
+/*
+ * lunix-user.h
+ *
+ * Helpers for userspace programs that map Lunix:TNG measurement
+ * pages [/dev/lunix<N>-<type>] or the region with the latest values
+ * of all sensors [/dev/lunix-all] and read them without a system
+ * call per sample.
+ *
+ * Both are updated under a seqcount, see lunix.h: a reader notes an
+ * even count, copies what it needs and retries if the count moved.
+ * Raw values read this way are converted in bulk with the tables of
+ * their node, see lunix_calib_read() and lunix-convert.h.
+ *
+ */
+
+#ifndef _LUNIX_USER_H
+#define _LUNIX_USER_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+
+#include "lunix.h"
+#include "lunix-calib.h"
+#include "lunix-chrdev.h"
+#include "lunix-convert.h"
+
+#define LUNIX_USER_ONCE(x)	(*(volatile __typeof__(x) *)&(x))
+#define lunix_user_rmb()	__atomic_thread_fence(__ATOMIC_ACQUIRE)
+
+static inline uint32_t lunix_user_read_begin(const uint32_t *seqcount)
+{
+	uint32_t start;
+
+	while ((start = LUNIX_USER_ONCE(*seqcount)) & 1)
+		;
+	lunix_user_rmb();
+	return start;
+}
+
+static inline int lunix_user_read_retry(const uint32_t *seqcount, uint32_t start)
+{
+	lunix_user_rmb();
+	return LUNIX_USER_ONCE(*seqcount) != start;
+}
+
+static inline void *lunix_user_map(const char *path, size_t len)
+{
+	void *p;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return NULL;
+	p = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	return p == MAP_FAILED ? NULL : p;
+}
+
+/*
+ * Measurement pages
+ */
+static inline const struct lunix_msr_data_struct *lunix_msr_map(const char *path)
+{
+	const struct lunix_msr_data_struct *msr;
+
+	if (!(msr = lunix_user_map(path, sizeof(*msr))))
+		return NULL;
+	if (msr->magic != LUNIX_MSR_MAGIC) {
+		munmap((void *)msr, sizeof(*msr));
+		errno = EINVAL;
+		return NULL;
+	}
+	return msr;
+}
+
+static inline void lunix_msr_unmap(const struct lunix_msr_data_struct *msr)
+{
+	munmap((void *)msr, sizeof(*msr));
+}
+
+/*
+ * Copies the newest sample to *sample. Returns 0,
+ * or -1 if nothing has been received yet.
+ */
+static inline int lunix_msr_latest(const struct lunix_msr_data_struct *msr,
+	struct lunix_msr_sample_struct *sample)
+{
+	uint32_t start;
+	uint64_t seq;
+
+	do {
+		start = lunix_user_read_begin(&msr->seqcount);
+		seq = msr->seq;
+		*sample = *lunix_msr_sample(msr, seq);
+	} while (lunix_user_read_retry(&msr->seqcount, start));
+
+	return seq ? 0 : -1;
+}
+
+/*
+ * Copies up to max samples newer than number *seq, oldest first, and
+ * moves *seq past them. Returns how many were copied. Samples that
+ * have already left the history are skipped; compare the seq of the
+ * first one with the previous *seq to notice.
+ */
+static inline int lunix_msr_since(const struct lunix_msr_data_struct *msr,
+	uint64_t *seq, struct lunix_msr_sample_struct *samples, int max)
+{
+	uint64_t last, first;
+	uint32_t start;
+	int i, n;
+
+	do {
+		start = lunix_user_read_begin(&msr->seqcount);
+		last = msr->seq;
+		n = 0;
+		if (*seq >= last || max <= 0)
+			continue;
+
+		/* Start no earlier than the oldest sample still kept */
+		first = *seq + 1;
+		if (last > LUNIX_MSR_HISTORY && first < last - LUNIX_MSR_HISTORY + 1)
+			first = last - LUNIX_MSR_HISTORY + 1;
+		n = last - first + 1 < (uint64_t)max ? (int)(last - first + 1) : max;
+		for (i = 0; i < n; i++)
+			samples[i] = *lunix_msr_sample(msr, first + i);
+	} while (lunix_user_read_retry(&msr->seqcount, start));
+
+	if (n > 0)
+		*seq = first + n - 1;
+	return n;
+}
+
+/*
+ * The latest values of all sensors
+ */
+struct lunix_all_entry_struct {
+	uint64_t seq;
+	uint64_t timestamp;
+	uint16_t batt;
+	uint16_t temp;
+	uint16_t light;
+};
+
+static inline const struct lunix_all_header_struct *lunix_all_map(const char *path)
+{
+	const struct lunix_all_header_struct *hdr;
+	uint32_t size;
+
+	/* The header tells how large the whole region is */
+	if (!(hdr = lunix_user_map(path, sizeof(*hdr))))
+		return NULL;
+	size = hdr->magic == LUNIX_ALL_MAGIC ? hdr->size : 0;
+	munmap((void *)hdr, sizeof(*hdr));
+	if (!size) {
+		errno = EINVAL;
+		return NULL;
+	}
+	return lunix_user_map(path, size);
+}
+
+static inline void lunix_all_unmap(const struct lunix_all_header_struct *hdr)
+{
+	munmap((void *)hdr, hdr->size);
+}
+
+/*
+ * Copies the latest values of sensor number i [node id i + 1].
+ * Returns 0, or -1 if nothing has been received from it yet.
+ */
+static inline int lunix_all_read(const struct lunix_all_header_struct *hdr,
+	unsigned int i, struct lunix_all_entry_struct *e)
+{
+	const uint32_t *seqcount = lunix_all_array(hdr, seqcount);
+	uint32_t start;
+
+	do {
+		start = lunix_user_read_begin(&seqcount[i]);
+		e->seq = ((const uint64_t *)lunix_all_array(hdr, seq))[i];
+		e->timestamp = ((const uint64_t *)lunix_all_array(hdr, timestamp))[i];
+		e->batt = ((const uint16_t *)lunix_all_array(hdr, batt))[i];
+		e->temp = ((const uint16_t *)lunix_all_array(hdr, temp))[i];
+		e->light = ((const uint16_t *)lunix_all_array(hdr, light))[i];
+	} while (lunix_user_read_retry(&seqcount[i], start));
+
+	return e->seq ? 0 : -1;
+}
+
+/*
+ * The conversion tables of a node, built from its calibration
+ * the way the module builds them, so that values converted here
+ * match those read from its device nodes.
+ */
+struct lunix_user_tables_struct {
+	uint32_t batt_num;		/* Battery past full scale: num / raw */
+	int32_t temp[LUNIX_CALIB_TABLE_SIZE];
+	int32_t batt[LUNIX_CALIB_TABLE_SIZE];
+};
+
+/*
+ * Uncalibrated nodes use the default tables of lunix-lookup.h, include
+ * it first to get them exactly; otherwise they are rebuilt from the
+ * default parameters, within a thousandth of a unit of the originals.
+ */
+static inline void lunix_user_tables_build(const struct lunix_calib_struct *calib,
+	struct lunix_user_tables_struct *t)
+{
+#ifdef LUNIX_LOOKUP_ADC_FS
+	unsigned int i;
+
+	if (lunix_calib_is_default(calib)) {
+		for (i = 0; i < LUNIX_CALIB_TABLE_SIZE; i++) {
+			t->temp[i] = lookup_temperature[i];
+			t->batt[i] = lookup_voltage[i];
+		}
+		t->batt_num = LUNIX_LOOKUP_BATT_NUM;
+		return;
+	}
+#endif
+	t->batt_num = lunix_calib_build(calib, t->temp, t->batt);
+}
+
+/*
+ * Reads the calibration of a node through any of its
+ * device nodes, and builds its tables. Returns 0 or -1.
+ */
+static inline int lunix_calib_read(const char *path, struct lunix_user_tables_struct *t)
+{
+	struct lunix_calib_struct calib;
+	int fd, ret;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return -1;
+	ret = ioctl(fd, LUNIX_IOC_GET_CALIB, &calib);
+	close(fd);
+	if (ret < 0)
+		return -1;
+
+	lunix_user_tables_build(&calib, t);
+	return 0;
+}
+
+/*
+ * Raw values to thousandths of a unit, n at a time
+ */
+static inline void lunix_user_convert_batt(const struct lunix_user_tables_struct *t,
+	const uint16_t *raw, int32_t *out, size_t n)
+{
+	lunix_convert_reciprocal(t->batt, LUNIX_CALIB_TABLE_SIZE - 1, t->batt_num, raw, out, n);
+}
+
+static inline void lunix_user_convert_temp(const struct lunix_user_tables_struct *t,
+	const uint16_t *raw, int32_t *out, size_t n)
+{
+	lunix_convert_clamped(t->temp, LUNIX_CALIB_TABLE_SIZE - 1, raw, out, n);
+}
+
+static inline void lunix_user_convert_light(const uint16_t *raw, int32_t *out, size_t n)
+{
+	lunix_convert_linear(LUNIX_CALIB_LIGHT_FS / 65535, LUNIX_CALIB_LIGHT_FS % 65535,
+		raw, out, n);
+}
+
+/*
+ * Converts the latest values of sensors first to first + n - 1 straight
+ * from the arrays of the region, with the tables t they all share [e.g.
+ * the defaults]. Each value is one of the latest, but the three of a
+ * sensor may come from different updates; see lunix_all_read() for that.
+ */
+static inline void lunix_all_convert(const struct lunix_all_header_struct *hdr,
+	unsigned int first, size_t n, const struct lunix_user_tables_struct *t,
+	int32_t *batt, int32_t *temp, int32_t *light)
+{
+	lunix_user_convert_batt(t, (const uint16_t *)lunix_all_array(hdr, batt) + first, batt, n);
+	lunix_user_convert_temp(t, (const uint16_t *)lunix_all_array(hdr, temp) + first, temp, n);
+	lunix_user_convert_light((const uint16_t *)lunix_all_array(hdr, light) + first, light, n);
+}
+
+/*
+ * Calibrates a node through any of its device nodes [needs
+ * CAP_SYS_ADMIN]: Steinhart-Hart coefficients, divider resistor
+ * in Ohm and battery reference in V, as in mk_lookup_tables.c.
+ */
+#define LUNIX_USER_ROUND(x)	((x) < 0 ? (x) - 0.5 : (x) + 0.5)
+
+static inline int lunix_calib_write(const char *path, double a, double b, double c,
+	double r1, double batt_ref)
+{
+	struct lunix_calib_struct calib;
+	int fd, ret;
+
+	calib.sh_a = LUNIX_USER_ROUND(a * 1e12);
+	calib.sh_b = LUNIX_USER_ROUND(b * 1e12);
+	calib.sh_c = LUNIX_USER_ROUND(c * 1e12);
+	calib.r1 = LUNIX_USER_ROUND(r1 * 1e3);
+	calib.batt_ref = LUNIX_USER_ROUND(batt_ref * 1e6);
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return -1;
+	ret = ioctl(fd, LUNIX_IOC_SET_CALIB, &calib);
+	close(fd);
+	return ret;
+}
+
+#endif	/* _LUNIX_USER_H */
@@ -24,10 +24,24 @@
  * A structure representing a hardware sensor
  * and pages holding the most recent measurements received
  */
-#define LUNIX_MSR_MAGIC 0xF00DF00D
-
 enum lunix_msr_enum { BATT = 0, TEMP, LIGHT, N_LUNIX_MSR };
+struct lunix_sensor_struct;
+
+/*
+ * Someone interested in only some of the updates of a sensor, e.g. an
+ * open file with a deadband. Watchers sleep on their own wait queue,
+ * which is only woken up when fire() says so, instead of on the wait
+ * queue of the sensor, which is woken up on every update.
+ */
+struct lunix_sensor_watch_struct {
+	struct list_head list;
+	int (*fire)(struct lunix_sensor_watch_struct *w, struct lunix_sensor_struct *s);
+	wait_queue_head_t wq;
+};
 struct lunix_sensor_struct {
+	/* Sensor number [node id - 1], the index in the sensor table */
+	unsigned int id;
+
 	/*
 	 * A number of pages, one for each measurement.
 	 * They can be mapped to userspace.
@@ -35,8 +49,23 @@ struct lunix_sensor_struct {
 	struct lunix_msr_data_struct *msr_data[N_LUNIX_MSR];
 
 	/*
-	 * Spinlock used to assert mutual exclusion between
-	 * the serial line discipline and the character device driver
+	 * Samples already converted and formatted by the character
+	 * device, shared by all of its open files. Allocated on the
+	 * first open of each measurement, and installed with cmpxchg()
+	 * so that open() stays off the lock below; see lunix-chrdev.h.
+	 */
+	struct lunix_chrdev_cache_struct *cache[N_LUNIX_MSR];
+
+	/*
+	 * Conversion tables built from the calibration of this node,
+	 * NULL for the defaults. Protected by RCU, see lunix-calib.c.
+	 */
+	struct lunix_calib_table_struct *calib;
+
+	/*
+	 * Spinlock used to assert mutual exclusion between line
+	 * discipline instances [TTYs] updating this sensor. Readers
+	 * never take it, see lunix_msr_read_begin().
 	 */
 	spinlock_t lock;
 
@@ -45,15 +74,28 @@ struct lunix_sensor_struct {
 	 * when this sensor has been updated with new data
 	 */
 	wait_queue_head_t wq;
+
+	/*
+	 * Watchers, asked one by one on every update whether
+	 * they want to be woken up, see lunix_sensor_watch()
+	 */
+	struct list_head watches;
+	spinlock_t watch_lock;
 };
 
 /*
- * The default value for the maximum number of sensors supported
+ * The default value for the maximum number of sensors supported,
+ * and the hard limit, since node ids are 16-bit quantities.
+ * Sensors are allocated on first use, see lunix_sensor_get().
  */
 #define LUNIX_SENSOR_CNT			16
+#define LUNIX_SENSOR_MAX			65535
 extern int lunix_sensor_cnt;
-extern struct lunix_sensor_struct *lunix_sensors;
-extern struct lunix_protocol_state_struct lunix_protocol_state;
+
+/*
+ * The structure-of-arrays copy of the latest values, see below
+ */
+extern struct lunix_all_header_struct *lunix_all;
 
 /*
  * Debugging
@@ -68,25 +110,133 @@ extern struct lunix_protocol_state_struct lunix_protocol_state;
 /*
  * Function prototypes
  */
-int lunix_sensor_init(struct lunix_sensor_struct *);
+int lunix_sensor_init(struct lunix_sensor_struct *, gfp_t gfp);
 void lunix_sensor_destroy(struct lunix_sensor_struct *);
+struct lunix_sensor_struct *lunix_sensor_lookup(unsigned int id);
+struct lunix_sensor_struct *lunix_sensor_get(unsigned int id, gfp_t gfp);
+void lunix_sensors_destroy(void);
+int lunix_all_init(void);
+void lunix_all_destroy(void);
 void lunix_sensor_update(struct lunix_sensor_struct *s,
 	uint16_t batt, uint16_t temp, uint16_t light);
+void lunix_sensor_publish(struct lunix_sensor_struct *s,
+	uint16_t batt, uint16_t temp, uint16_t light);
+void lunix_sensor_wake_up(struct lunix_sensor_struct *s);
+void lunix_sensor_watch(struct lunix_sensor_struct *s, struct lunix_sensor_watch_struct *w);
+void lunix_sensor_unwatch(struct lunix_sensor_struct *s, struct lunix_sensor_watch_struct *w);
 
 #else
 #include <inttypes.h>
 #endif	/* __KERNEL__ */
 /*
  * A structure, living at the start of a page, containing a version number
- * [timestamp of last update] and a variable number of 32-bit quantities. It is
- * meant to be mappable to userspace.
+ * [sequence number of the newest sample], the time of the last update and
+ * a ring holding the most recent samples of a measurement. It is meant to
+ * be mappable to userspace.
+ *
+ * Sample number seq lives in samples[seq % LUNIX_MSR_HISTORY]. Samples are
+ * numbered from 1, seq is the number of the newest one [0: no samples yet].
+ * It is 64-bit, so it never wraps around, and it moves on every packet:
+ * comparing sequence numbers tells exactly whether there is new data, no
+ * matter how many packets arrive per second.
+ * A reader that last saw sample number n can pick up everything that
+ * arrived since, as long as seq - n <= LUNIX_MSR_HISTORY.
+ *
+ * Timestamps are CLOCK_MONOTONIC [ktime_get()] in nanoseconds.
+ *
+ * Updates are published seqcount-style through seqcount, which is odd
+ * while an update is in progress. Readers never lock: they note an even
+ * seqcount, read what they need, and retry if seqcount has changed
+ * meanwhile. The counter lives in the page itself so that processes
+ * mapping it can follow the same protocol.
  */
+#define LUNIX_MSR_MAGIC		0xF00DF00D
+#define LUNIX_MSR_HISTORY	128	/* Must be a power of 2 */
+
+struct lunix_msr_sample_struct {
+	uint64_t seq;
+	uint64_t timestamp;
+	uint32_t value;
+	uint32_t reserved;
+};
+
 struct lunix_msr_data_struct {
 	uint32_t magic;
-	uint32_t last_update;
-	uint32_t values[];
+	uint32_t seqcount;
+	uint64_t seq;
+	uint64_t last_update;
+	struct lunix_msr_sample_struct samples[LUNIX_MSR_HISTORY];
+};
+
+#define lunix_msr_sample(msr, n) \
+	(&(msr)->samples[(n) & (LUNIX_MSR_HISTORY - 1)])
+
+#ifdef __KERNEL__
+/*
+ * Reader side of the seqcount protocol, e.g.
+ *
+ *	do {
+ *		start = lunix_msr_read_begin(msr);
+ *		... copy data out of msr ...
+ *	} while (lunix_msr_read_retry(msr, start));
+ */
+static inline uint32_t lunix_read_begin(const uint32_t *seqcount)
+{
+	uint32_t start;
+
+	while ((start = ACCESS_ONCE(*seqcount)) & 1)
+		cpu_relax();
+	smp_rmb();
+	return start;
+}
+
+static inline int lunix_read_retry(const uint32_t *seqcount, uint32_t start)
+{
+	smp_rmb();
+	return unlikely(ACCESS_ONCE(*seqcount) != start);
+}
+
+#define lunix_msr_read_begin(msr)		lunix_read_begin(&(msr)->seqcount)
+#define lunix_msr_read_retry(msr, start)	lunix_read_retry(&(msr)->seqcount, (start))
+#endif	/* __KERNEL__ */
+
+/*
+ * The latest values of all sensors in a single region, laid out as a
+ * structure of arrays: entry i of every array belongs to sensor number i
+ * [node id i + 1]. It is mapped to userspace through /dev/lunix-all, so
+ * a process can scan every node in one go, with SIMD if it so wishes.
+ *
+ * The arrays follow the header, each one starting at the given offset
+ * from the start of the region, cache line aligned:
+ *
+ *	uint32_t seqcount[nsensors];	Odd while entry i is being updated
+ *	uint64_t seq[nsensors];		Sample number of the latest update, 0: no data yet
+ *	uint64_t timestamp[nsensors];	Of the latest update [ns]
+ *	uint16_t batt[nsensors];	Latest raw values
+ *	uint16_t temp[nsensors];
+ *	uint16_t light[nsensors];
+ *
+ * Entry i follows the same protocol as the measurement pages: note an
+ * even seqcount[i], read the values, retry if seqcount[i] has changed.
+ */
+#define LUNIX_ALL_MAGIC		0xA11DA7A0
+
+struct lunix_all_header_struct {
+	uint32_t magic;
+	uint32_t nsensors;
+	uint32_t size;			/* Of the whole region, in bytes */
+	uint32_t seqcount_off;
+	uint32_t seq_off;
+	uint32_t timestamp_off;
+	uint32_t batt_off;
+	uint32_t temp_off;
+	uint32_t light_off;
+	uint32_t reserved;
 };
 
+#define lunix_all_array(hdr, field) \
+	((void *)((char *)(hdr) + (hdr)->field##_off))
+
 /*
  * Lunix:TNG line discipline number:
  * Hijack the "Mobitex module" line discipline, since the number
@@ -10,3 +10,9 @@ for sensor in $(seq 0 1 15); do
 	mknod /dev/lunix$sensor-temp c 60 $[$sensor * 8 + 1]
 	mknod /dev/lunix$sensor-light c 60 $[$sensor * 8 + 2]
 done
+
+# The latest values of all sensors, in a single mappable region
+mknod /dev/lunix-all c 60 $[65535 * 8]
+
+# Every update of every sensor, in arrival order
+mknod /dev/lunix-events c 60 $[65535 * 8 + 1]
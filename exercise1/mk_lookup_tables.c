@@ -5,15 +5,28 @@
  * lookup tables for converting 16-bit raw measurements
  * from the wireless sensors to actual floating point values.
  *
+ * By default emits the compact tables used by the module, see
+ * compact_*() below; -l emits the original 65536-entry tables of
+ * long, -b compares the accuracy and speed of the candidate formats,
+ * -c checks the fixed-point code the module shares with userspace.
+ *
  * Ioannis Panagopoulos <ioannis@cslab.ece.ntua.gr>
  * Vangelis Koukis <vkoukis@cslab.ece.ntua.gr>
  *
  */
 
 #include <math.h>
+#include <time.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <inttypes.h>
 
+#include "lunix-calib.h"
+#include "lunix-convert.h"
+#include "lunix-format.h"
+
 /*
  * Translates the received uint16_t value to voltage level
  */
@@ -66,7 +79,156 @@ long uint16_to_temp(uint16_t value)
 	return (l < -272150) ?  -272150 : l;
 }
 
-int main(void)
+/*
+ * The ADC is 10-bit: temperature and battery only need a table up to
+ * full scale, 4 KiB of int32_t each, which stays in L1. Past full scale
+ * every temperature reads as the clamped minimum, the battery formula
+ * is exact in integers, and so is the light one, which needs no table.
+ * main() checks all of this against the functions above for every raw
+ * value before emitting anything, so the compact tables are exact.
+ */
+#define ADC_FS		1023
+#define COMPACT_SIZE	(ADC_FS + 1)
+
+static int32_t compact_temperature[COMPACT_SIZE];
+static int32_t compact_voltage[COMPACT_SIZE];
+static long temp_min, batt_num, light_fs;
+
+/*
+ * uint16_to_temp() past full scale, where the thermistor resistance
+ * turns negative: its log is NaN, and converting that to long is
+ * undefined. The reading is below anything the formula can express,
+ * so the reference is the floor uint16_to_temp() clamps to.
+ */
+#define TEMP_FLOOR	-272150L
+
+static long reference_temp(uint16_t raw)
+{
+	return raw < ADC_FS ? uint16_to_temp(raw) : TEMP_FLOOR;
+}
+
+static inline int32_t compact_temp(uint16_t raw)
+{
+	return compact_temperature[raw < ADC_FS ? raw : ADC_FS];
+}
+
+static inline int32_t compact_batt(uint16_t raw)
+{
+	if (raw <= ADC_FS)
+		return compact_voltage[raw];
+	return batt_num / raw;
+}
+
+static inline int32_t compact_light(uint16_t raw)
+{
+	return (light_fs / 65535) * raw + (uint32_t)(light_fs % 65535) * raw / 65535;
+}
+
+static void compact_init(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < COMPACT_SIZE; i++) {
+		compact_temperature[i] = uint16_to_temp(i);
+		compact_voltage[i] = uint16_to_batt(i);
+	}
+	temp_min = uint16_to_temp(ADC_FS);
+	batt_num = uint16_to_batt(1);
+	light_fs = uint16_to_light(65535);
+}
+
+static int compact_check(void)
+{
+	unsigned int i, bad = 0;
+
+	for (i = 0; i <= 0xFFFF; i++) {
+		if (compact_temp(i) != reference_temp(i) ||
+		    compact_batt(i) != uint16_to_batt(i) ||
+		    compact_light(i) != uint16_to_light(i)) {
+			if (bad++ < 10)
+				fprintf(stderr, "compact tables differ at raw value %u\n", i);
+		}
+	}
+	return bad ? -1 : 0;
+}
+
+static void print_table(const char *decl, const int32_t *t, unsigned int n)
+{
+	unsigned int i;
+
+	fprintf(stdout, "static const %s[%u] = {\n", decl, n);
+	for (i = 0; i < n; i += 4) {
+		fprintf(stdout, "\t%" PRId32 ", %" PRId32 ", %" PRId32 ", %" PRId32,
+			t[i], t[i+1], t[i+2], t[i+3]);
+		fprintf(stdout, (i != n - 4) ? ",\n" : "\n");
+	}
+	fprintf(stdout, "};\n\n");
+}
+
+static void print_compact(void)
+{
+	fprintf(stdout,
+		"/*\n"
+		" * lunix-lookup.h\n"
+		" *\n"
+		" * Machine-generated file. DO NOT EDIT.\n"
+		" * See %s instead.\n"
+		" *\n"
+		" * Instead of doing floating-point in kernelspace,\n"
+		" * use the following to convert 16-bit raw measurements\n"
+		" * to thousandths of a unit. Tables only cover the 10-bit\n"
+		" * ADC range; the results are exact for every raw value.\n"
+		" */\n"
+		"\n"
+		"#ifndef _LUNIX_LOOKUP_H\n"
+		"#define _LUNIX_LOOKUP_H\n"
+		"\n"
+		"#ifdef __KERNEL__\n"
+		"#include <linux/types.h>\n"
+		"#else\n"
+		"#include <stdint.h>\n"
+		"#endif\n"
+		"\n"
+		"#define LUNIX_LOOKUP_ADC_FS\t%d\n"
+		"#define LUNIX_LOOKUP_BATT_NUM\t%ldU\t/* Battery: num / raw */\n"
+		"#define LUNIX_LOOKUP_LIGHT_Q\t%ldU\t/* Light: raw * (q * 65535 + r) / 65535 */\n"
+		"#define LUNIX_LOOKUP_LIGHT_R\t%ldU\n"
+		"\n", __FILE__, ADC_FS, batt_num, light_fs / 65535, light_fs % 65535);
+
+	print_table("int32_t lookup_temperature", compact_temperature, COMPACT_SIZE);
+	print_table("int32_t lookup_voltage", compact_voltage, COMPACT_SIZE);
+
+	fprintf(stdout,
+		"/* Past full scale every temperature reads as %ld */\n"
+		"static inline int32_t lunix_lookup_temp(uint16_t raw)\n"
+		"{\n"
+		"\treturn lookup_temperature[raw < LUNIX_LOOKUP_ADC_FS ? raw : LUNIX_LOOKUP_ADC_FS];\n"
+		"}\n"
+		"\n"
+		"static inline int32_t lunix_lookup_batt(uint16_t raw)\n"
+		"{\n"
+		"\tif (raw <= LUNIX_LOOKUP_ADC_FS)\n"
+		"\t\treturn lookup_voltage[raw];\n"
+		"\treturn LUNIX_LOOKUP_BATT_NUM / raw;\n"
+		"}\n"
+		"\n"
+		"/* raw * %ld / 65535, in 32 bits */\n"
+		"static inline int32_t lunix_lookup_light(uint16_t raw)\n"
+		"{\n"
+		"\treturn LUNIX_LOOKUP_LIGHT_Q * raw + LUNIX_LOOKUP_LIGHT_R * raw / 65535;\n"
+		"}\n"
+		"\n"
+		"#endif\t/* _LUNIX_LOOKUP_H */\n",
+		temp_min, light_fs);
+}
+
+/*
+ * The original tables, one long for each of the 65536 raw values,
+ * behind the same lunix_lookup_*() helpers as the compact ones so
+ * that the module builds with either. LUNIX_LOOKUP_ADC_FS is left
+ * undefined: lunix-convert.h only takes tables of int32_t.
+ */
+static void print_legacy(void)
 {
 	unsigned int i;
 
@@ -82,6 +244,15 @@ int main(void)
 		" * raw measurements to floating point values.\n"
 		" */\n"
 		"\n"
+		"#ifndef _LUNIX_LOOKUP_H\n"
+		"#define _LUNIX_LOOKUP_H\n"
+		"\n"
+		"#ifdef __KERNEL__\n"
+		"#include <linux/types.h>\n"
+		"#else\n"
+		"#include <stdint.h>\n"
+		"#endif\n"
+		"\n"
 		"long lookup_temperature[65536] = {\n", __FILE__);
 
 	/*
@@ -119,7 +290,512 @@ int main(void)
 		fprintf(stdout, (i != 0xFFFC) ? ",\n" : "\n");
 	}
 
-	fprintf(stdout, "};\n\n");
+	fprintf(stdout, "};\n\n"
+		"static inline int32_t lunix_lookup_temp(uint16_t raw)\n"
+		"{\n"
+		"\treturn lookup_temperature[raw];\n"
+		"}\n"
+		"\n"
+		"static inline int32_t lunix_lookup_batt(uint16_t raw)\n"
+		"{\n"
+		"\treturn lookup_voltage[raw];\n"
+		"}\n"
+		"\n"
+		"static inline int32_t lunix_lookup_light(uint16_t raw)\n"
+		"{\n"
+		"\treturn lookup_light[raw];\n"
+		"}\n"
+		"\n"
+		"#endif\t/* _LUNIX_LOOKUP_H */\n");
+}
+
+/*
+ * Benchmark: the candidate formats against the original tables
+ *
+ * Besides the original and the compact tables, two smaller ones that
+ * are not exact: 16-bit entries [value = base + entry * step, with the
+ * smallest step that covers the range], and piecewise-linear
+ * interpolation between knots every SEG_LEN raw values.
+ */
+#define BENCH_SAMPLES	(1 << 20)
+#define BENCH_ROUNDS	20
+#define SEG_SHIFT	4
+#define SEG_LEN		(1 << SEG_SHIFT)
+#define SEG_CNT		(COMPACT_SIZE / SEG_LEN)
+
+static long legacy_temperature[65536], legacy_voltage[65536], legacy_light[65536];
+
+static uint16_t u16_temperature[COMPACT_SIZE], u16_voltage[COMPACT_SIZE];
+static long u16_temp_base, u16_temp_step, u16_batt_base, u16_batt_step;
+
+static int32_t seg_temperature[SEG_CNT + 1], seg_voltage[SEG_CNT + 1];
+
+static void u16_init(uint16_t *t, long *base, long *step, long (*f)(uint16_t))
+{
+	long lo, hi, v;
+	unsigned int i;
+
+	/* Raw value 0 is meaningless for both, leave it out of the range */
+	lo = hi = f(1);
+	for (i = 1; i < COMPACT_SIZE; i++) {
+		v = f(i);
+		lo = v < lo ? v : lo;
+		hi = v > hi ? v : hi;
+	}
+	*base = lo;
+	*step = (hi - lo + 65534) / 65535;
+	for (i = 0; i < COMPACT_SIZE; i++) {
+		v = f(i) < lo ? lo : f(i);
+		t[i] = (v - lo + *step / 2) / *step;
+	}
+}
+
+static void bench_init(void)
+{
+	unsigned int i;
+
+	for (i = 0; i <= 0xFFFF; i++) {
+		legacy_temperature[i] = reference_temp(i);
+		legacy_voltage[i] = uint16_to_batt(i);
+		legacy_light[i] = uint16_to_light(i);
+	}
+	u16_init(u16_temperature, &u16_temp_base, &u16_temp_step, uint16_to_temp);
+	u16_init(u16_voltage, &u16_batt_base, &u16_batt_step, uint16_to_batt);
+	/* Knots at 1 instead of 0 and at full scale - 1, the ends are degenerate */
+	for (i = 0; i <= SEG_CNT; i++) {
+		seg_temperature[i] = uint16_to_temp(i == 0 ? 1 : i < SEG_CNT ? i * SEG_LEN : ADC_FS - 1);
+		seg_voltage[i] = uint16_to_batt(i == 0 ? 1 : i < SEG_CNT ? i * SEG_LEN : ADC_FS - 1);
+	}
+}
+
+static inline int32_t legacy_temp(uint16_t raw) { return legacy_temperature[raw]; }
+static inline int32_t legacy_batt(uint16_t raw) { return legacy_voltage[raw]; }
+static inline int32_t legacy_lght(uint16_t raw) { return legacy_light[raw]; }
+
+static inline int32_t u16_temp(uint16_t raw)
+{
+	raw = raw < ADC_FS ? raw : ADC_FS;
+	return u16_temp_base + u16_temperature[raw] * u16_temp_step;
+}
+
+static inline int32_t u16_batt(uint16_t raw)
+{
+	raw = raw < ADC_FS ? raw : ADC_FS;
+	return u16_batt_base + u16_voltage[raw] * u16_batt_step;
+}
+
+static inline int32_t seg_interp(const int32_t *knots, uint16_t raw)
+{
+	unsigned int k, f;
+
+	raw = raw < ADC_FS ? raw : ADC_FS;
+	k = raw >> SEG_SHIFT;
+	f = raw & (SEG_LEN - 1);
+	return knots[k] + (((knots[k + 1] - knots[k]) * (int32_t)f) >> SEG_SHIFT);
+}
+
+static inline int32_t seg_temp(uint16_t raw) { return seg_interp(seg_temperature, raw); }
+static inline int32_t seg_batt(uint16_t raw) { return seg_interp(seg_voltage, raw); }
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint16_t *samples_adc, *samples_full;
+static volatile uint32_t bench_sink;
+
+/*
+ * Times conv over samples, and finds its largest error against the
+ * original tables: within the ADC range, leaving out raw values 0 and
+ * full scale [open and shorted sensor], and over all 65536 raw values.
+ */
+#define BENCH(name, conv, ref, samples, bytes)					\
+static void bench_##name(void)							\
+{										\
+	long err, err_adc = 0, err_all = 0;					\
+	unsigned int i, r;							\
+	uint32_t sum = 0;							\
+	double t;								\
+										\
+	for (i = 0; i <= 0xFFFF; i++) {						\
+		err = labs((long)conv(i) - ref(i));				\
+		if (i > 0 && i < ADC_FS && err > err_adc)			\
+			err_adc = err;						\
+		if (err > err_all)						\
+			err_all = err;						\
+	}									\
+										\
+	t = now();								\
+	for (r = 0; r < BENCH_ROUNDS; r++)					\
+		for (i = 0; i < BENCH_SAMPLES; i++)				\
+			sum += conv(samples[i]);				\
+	t = now() - t;								\
+	bench_sink = sum;							\
+										\
+	printf("%-24s %10lu %12ld %12ld %10.2f\n", #name, (unsigned long)(bytes),	\
+		err_adc, err_all, t * 1e9 / BENCH_ROUNDS / BENCH_SAMPLES);	\
+}
+
+BENCH(temp_long_65536, legacy_temp, reference_temp, samples_adc, sizeof(legacy_temperature))
+BENCH(temp_int32_1024, compact_temp, reference_temp, samples_adc, sizeof(compact_temperature))
+BENCH(temp_uint16_1024, u16_temp, reference_temp, samples_adc, sizeof(u16_temperature))
+BENCH(temp_linear_64, seg_temp, reference_temp, samples_adc, sizeof(seg_temperature))
+BENCH(batt_long_65536, legacy_batt, uint16_to_batt, samples_adc, sizeof(legacy_voltage))
+BENCH(batt_int32_1024, compact_batt, uint16_to_batt, samples_adc, sizeof(compact_voltage))
+BENCH(batt_uint16_1024, u16_batt, uint16_to_batt, samples_adc, sizeof(u16_voltage))
+BENCH(batt_linear_64, seg_batt, uint16_to_batt, samples_adc, sizeof(seg_voltage))
+BENCH(light_long_65536, legacy_lght, uint16_to_light, samples_full, sizeof(legacy_light))
+BENCH(light_arith, compact_light, uint16_to_light, samples_full, 0)
+
+/*
+ * The same, a whole array at a time, see lunix-convert.h
+ */
+#define BENCH_BATCH	256
+
+static int32_t batch_out[65536];
+
+#define BENCH_BATCH_CONV(name, batch, ref, samples, bytes)			\
+static void bench_##name(void)							\
+{										\
+	static uint16_t all[65536];						\
+	long err, err_adc = 0, err_all = 0;					\
+	unsigned int i, j, r;							\
+	uint32_t sum = 0;							\
+	double t;								\
+										\
+	for (i = 0; i <= 0xFFFF; i++)						\
+		all[i] = i;							\
+	batch(all, batch_out, 65536);						\
+	for (i = 0; i <= 0xFFFF; i++) {						\
+		err = labs((long)batch_out[i] - ref(i));			\
+		if (i > 0 && i < ADC_FS && err > err_adc)			\
+			err_adc = err;						\
+		if (err > err_all)						\
+			err_all = err;						\
+	}									\
+										\
+	t = now();								\
+	for (r = 0; r < BENCH_ROUNDS; r++)					\
+		for (i = 0; i < BENCH_SAMPLES; i += BENCH_BATCH) {		\
+			batch(&samples[i], batch_out, BENCH_BATCH);		\
+			for (j = 0; j < BENCH_BATCH; j++)			\
+				sum += batch_out[j];				\
+		}								\
+	t = now() - t;								\
+	bench_sink = sum;							\
+										\
+	printf("%-24s %10lu %12ld %12ld %10.2f\n", #name, (unsigned long)(bytes),	\
+		err_adc, err_all, t * 1e9 / BENCH_ROUNDS / BENCH_SAMPLES);	\
+}
+
+/* Out of line, the way a program would call them on its buffers */
+static __attribute__((noinline)) void temp_batch(const uint16_t *raw, int32_t *out, size_t n)
+{
+	lunix_convert_clamped(compact_temperature, ADC_FS, raw, out, n);
+}
+
+static __attribute__((noinline)) void batt_batch(const uint16_t *raw, int32_t *out, size_t n)
+{
+	lunix_convert_reciprocal(compact_voltage, ADC_FS, batt_num, raw, out, n);
+}
+
+static __attribute__((noinline)) void light_batch(const uint16_t *raw, int32_t *out, size_t n)
+{
+	lunix_convert_linear(light_fs / 65535, light_fs % 65535, raw, out, n);
+}
+
+BENCH_BATCH_CONV(temp_int32_1024_batch, temp_batch, reference_temp, samples_adc, sizeof(compact_temperature))
+BENCH_BATCH_CONV(batt_int32_1024_batch, batt_batch, uint16_to_batt, samples_adc, sizeof(compact_voltage))
+BENCH_BATCH_CONV(light_arith_batch, light_batch, uint16_to_light, samples_full, 0)
+
+/*
+ * Text formatting, lunix-format.h against snprintf
+ */
+static int format_fixed(unsigned char *buf, int32_t value, int decimals)
+{
+	switch (decimals) {
+	case 0: return lunix_format_fixed(buf, value, 0);
+	case 1: return lunix_format_fixed(buf, value, 1);
+	case 2: return lunix_format_fixed(buf, value, 2);
+	default: return lunix_format_fixed(buf, value, 3);
+	}
+}
+
+/*
+ * The same with printf: value in thousandths, rounded half away
+ * from zero, and no sign on values that round to zero
+ */
+static int format_printf(char *buf, size_t len, int32_t value, int decimals)
+{
+	int64_t div = 1, pow = 1, scaled;
+	int i;
+
+	for (i = decimals; i < 3; i++)
+		div *= 10;
+	for (i = 0; i < decimals; i++)
+		pow *= 10;
+	scaled = ((value < 0 ? -(int64_t)value : value) + div / 2) / div;
+
+	if (!decimals)
+		return snprintf(buf, len, "%s%" PRId64 "\n",
+			value < 0 && scaled ? "-" : "", scaled);
+	return snprintf(buf, len, "%s%" PRId64 ".%0*" PRId64 "\n",
+		value < 0 && scaled ? "-" : "", scaled / pow, decimals, scaled % pow);
+}
+
+static void bench_format(void)
+{
+	unsigned char buf[32];
+	char ref[32];
+	unsigned int i, r;
+	uint32_t sum = 0;
+	double t;
+
+	t = now();
+	for (r = 0; r < BENCH_ROUNDS; r++)
+		for (i = 0; i < BENCH_SAMPLES; i++)
+			sum += lunix_format_fixed(buf, batch_out[i & 0xFFFF] - 40000, 2);
+	t = now() - t;
+	printf("%-24s %10.2f\n", "format_fixed", t * 1e9 / BENCH_ROUNDS / BENCH_SAMPLES);
+
+	t = now();
+	for (r = 0; r < BENCH_ROUNDS; r++)
+		for (i = 0; i < BENCH_SAMPLES; i++)
+			sum += snprintf(ref, sizeof(ref), "%d.%02d\n",
+				(batch_out[i & 0xFFFF] - 40000) / 1000,
+				abs(batch_out[i & 0xFFFF] - 40000) % 1000 / 10);
+	t = now() - t;
+	printf("%-24s %10.2f\n", "snprintf", t * 1e9 / BENCH_ROUNDS / BENCH_SAMPLES);
+	bench_sink = sum;
+}
+
+static void bench(void)
+{
+	unsigned int i;
+
+	bench_init();
+	samples_adc = malloc(BENCH_SAMPLES * sizeof(*samples_adc));
+	samples_full = malloc(BENCH_SAMPLES * sizeof(*samples_full));
+	if (!samples_adc || !samples_full) {
+		perror("malloc");
+		exit(1);
+	}
+	srand(1);
+	for (i = 0; i < BENCH_SAMPLES; i++) {
+		samples_adc[i] = rand() % COMPACT_SIZE;
+		samples_full[i] = rand() & 0xFFFF;
+	}
+
+	printf("%-24s %10s %12s %12s %10s\n",
+		"format", "bytes", "maxerr[adc]", "maxerr[all]", "ns/conv");
+	bench_temp_long_65536();
+	bench_temp_int32_1024();
+	bench_temp_uint16_1024();
+	bench_temp_linear_64();
+	bench_batt_long_65536();
+	bench_batt_int32_1024();
+	bench_batt_uint16_1024();
+	bench_batt_linear_64();
+	bench_light_long_65536();
+	bench_light_arith();
+	printf("batch conversion: " LUNIX_CONVERT_IMPL "\n");
+	bench_temp_int32_1024_batch();
+	bench_batt_int32_1024_batch();
+	bench_light_arith_batch();
+	printf("\n%-24s %10s\n", "text formatting", "ns/value");
+	bench_format();
+
+	free(samples_adc);
+	free(samples_full);
+}
+
+/*
+ * Checks of the fixed-point code the module shares with userspace
+ */
+#define CHECK_SPAN	2000000		/* Every value within +-2000.000 */
+#define CHECK_RANDOM	(1 << 21)
+
+static int check_format_value(int32_t value, unsigned int *bad)
+{
+	unsigned char buf[32];
+	char ref[32];
+	int d, len;
+
+	for (d = 0; d <= 3; d++) {
+		len = format_fixed(buf, value, d);
+		if (len == format_printf(ref, sizeof(ref), value, d) &&
+		    !memcmp(buf, ref, len))
+			continue;
+		if ((*bad)++ < 10)
+			fprintf(stderr, "format: %" PRId32 " with %d decimals: "
+				"\"%.*s\", printf \"%s\"\n", value, d, len, buf, ref);
+	}
+	return 4;
+}
+
+/*
+ * lunix_format_fixed() against printf at every precision: every value
+ * in a range, the neighbourhood of every power of ten [digit count and
+ * rounding edges], the extremes, and random ones.
+ */
+static int check_format(void)
+{
+	unsigned int bad = 0, n = 0, i;
+	int64_t p10;
+	int32_t v, off;
+
+	for (v = -CHECK_SPAN; v <= CHECK_SPAN; v++)
+		n += check_format_value(v, &bad);
+	for (p10 = 1; p10 <= INT32_MAX; p10 *= 10)
+		for (off = -600; off <= 600; off++)
+			if (p10 + off > 0 && p10 + off <= INT32_MAX) {
+				n += check_format_value(p10 + off, &bad);
+				n += check_format_value(-(p10 + off), &bad);
+			}
+	n += check_format_value(INT32_MIN, &bad);
+	n += check_format_value(INT32_MIN + 1, &bad);
+	n += check_format_value(INT32_MAX, &bad);
+	srand(1);
+	for (i = 0; i < CHECK_RANDOM; i++)
+		n += check_format_value((int32_t)((uint32_t)rand() << 16 ^ (uint32_t)rand()), &bad);
+
+	printf("%-24s %10u checked, %u wrong\n", "format_fixed", n, bad);
+	return bad ? -1 : 0;
+}
+
+/*
+ * The tables of a calibrated node, built in fixed point by the module
+ * [see lunix-calib.h], against uint16_to_temp() and uint16_to_batt()
+ * with the same parameters in double precision, for the defaults and
+ * for random parameter sets around them.
+ */
+#define CHECK_CALIB_SETS	200
+#define CHECK_CALIB_MAXERR	2	/* m°C, mV */
+
+static long calib_temp(const struct lunix_calib_struct *p, unsigned int raw)
+{
+	double Rth, Kelvin_Inv, res;
+	double a = p->sh_a * 1e-12, b = p->sh_b * 1e-12, c = p->sh_c * 1e-12;
+	long l;
+
+	Rth = (p->r1 * 1e-3 * (ADC_FS - (double)raw)) / (double)raw;
+	Kelvin_Inv = a + b * log(Rth) + c * pow(log(Rth), 3);
+	res = (1.0 / Kelvin_Inv) - 272.15;
+	l = (long)(res * 1000);
+
+	return (l < -272150) ? -272150 : l;
+}
+
+static long calib_batt(const struct lunix_calib_struct *p, unsigned int raw)
+{
+	return raw ? (long)(p->batt_ref * 1e-6 * (1023.0 / raw) * 1000) : 0;
+}
+
+static double rand_range(double lo, double hi)
+{
+	return lo + (hi - lo) * rand() / RAND_MAX;
+}
+
+static long check_calib_set(const struct lunix_calib_struct *p, int defaults)
+{
+	int32_t temp[LUNIX_CALIB_TABLE_SIZE], batt[LUNIX_CALIB_TABLE_SIZE];
+	long err, maxerr = 0;
+	unsigned int i;
+
+	lunix_calib_build(p, temp, batt);
+	for (i = 0; i < LUNIX_CALIB_TABLE_SIZE; i++) {
+		err = labs(temp[i] - (defaults ? uint16_to_temp(i) : calib_temp(p, i)));
+		maxerr = err > maxerr ? err : maxerr;
+		err = labs(batt[i] - (defaults ? uint16_to_batt(i) : calib_batt(p, i)));
+		maxerr = err > maxerr ? err : maxerr;
+	}
+	return maxerr;
+}
+
+static int check_calib(void)
+{
+	struct lunix_calib_struct p = {
+		LUNIX_CALIB_SH_A, LUNIX_CALIB_SH_B, LUNIX_CALIB_SH_C,
+		LUNIX_CALIB_R1, LUNIX_CALIB_BATT_REF
+	};
+	long err, err_def, err_rand = 0;
+	unsigned int i;
+
+	err_def = check_calib_set(&p, 1);
+
+	srand(1);
+	for (i = 0; i < CHECK_CALIB_SETS; i++) {
+		p.sh_a = LUNIX_CALIB_SH_A * rand_range(0.8, 1.2);
+		p.sh_b = LUNIX_CALIB_SH_B * rand_range(0.8, 1.2);
+		p.sh_c = LUNIX_CALIB_SH_C * rand_range(0.5, 1.5);
+		p.r1 = rand_range(1e6, 1e8);		/* 1k to 100k */
+		p.batt_ref = rand_range(1e6, 5e6);	/* 1 V to 5 V */
+		if (!lunix_calib_valid(&p))
+			continue;
+		err = check_calib_set(&p, 0);
+		if (err > CHECK_CALIB_MAXERR)
+			fprintf(stderr, "calib: a %" PRId64 " b %" PRId64 " c %" PRId64
+				" r1 %" PRIu32 " ref %" PRIu32 ": off by %ld\n",
+				p.sh_a, p.sh_b, p.sh_c, p.r1, p.batt_ref, err);
+		err_rand = err > err_rand ? err : err_rand;
+	}
+
+	printf("%-24s %10ld maxerr, defaults\n", "calib_build", err_def);
+	printf("%-24s %10ld maxerr, %d random sets\n", "calib_build", err_rand,
+		CHECK_CALIB_SETS);
+	return err_def > CHECK_CALIB_MAXERR || err_rand > CHECK_CALIB_MAXERR ? -1 : 0;
+}
+
+static int check(void)
+{
+	int ret = 0;
+
+	if (check_format() < 0)
+		ret = -1;
+	if (check_calib() < 0)
+		ret = -1;
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	int opt, legacy = 0, do_bench = 0, do_check = 0;
+
+	while ((opt = getopt(argc, argv, "lbc")) != -1) {
+		switch (opt) {
+		case 'l': legacy = 1; break;
+		case 'b': do_bench = 1; break;
+		case 'c': do_check = 1; break;
+		default:
+			fprintf(stderr, "Usage: %s [-l | -b | -c]\n\n"
+				"Emit the compact lookup tables used by Lunix:TNG.\n\n"
+				"  -l  emit the full 65536-entry tables of long instead\n"
+				"  -b  compare the accuracy and speed of table formats\n"
+				"  -c  check the fixed-point code shared with the module\n",
+				argv[0]);
+			return 1;
+		}
+	}
+
+	if (legacy) {
+		print_legacy();
+		return 0;
+	}
+
+	compact_init();
+	if (compact_check() < 0)
+		return 1;
+
+	if (do_check)
+		return check() < 0 ? 1 : 0;
+	if (do_bench)
+		bench();
+	else
+		print_compact();
 
 	return 0;
 }
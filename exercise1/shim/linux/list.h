@@ -0,0 +1 @@
+#include "../lunix-shim.h"
@@ -0,0 +1,314 @@
+/*
+ * lunix-shim.h
+ *
+ * Thin userspace stand-ins for the kernel facilities used by
+ * lunix-protocol.c and lunix-sensors.c, so that they can be built
+ * unmodified into userspace tools such as lunix-bench.
+ *
+ * Every <linux/...> and <asm/...> header below shim/ just includes
+ * this file. Only what the Lunix:TNG sources actually use is provided.
+ *
+ */
+
+#ifndef _LUNIX_SHIM_H
+#define _LUNIX_SHIM_H
+
+#include <time.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+#include <pthread.h>
+
+#define LUNIX_SHIM	1
+
+/*
+ * Kernel logging. Messages are dropped unless the tool using
+ * the shim sets lunix_shim_verbose, so that warnings on the
+ * receive path do not dominate benchmark timings.
+ */
+extern int lunix_shim_verbose;
+
+#define KERN_ERR	""
+#define KERN_WARNING	""
+#define KERN_INFO	""
+#define KERN_DEBUG	""
+
+#define printk(fmt, arg...) \
+	do { if (lunix_shim_verbose) fprintf(stderr, fmt, ##arg); } while (0)
+
+#define BUILD_BUG_ON(cond)	((void)sizeof(char[1 - 2 * !!(cond)]))
+
+#define likely(x)	__builtin_expect(!!(x), 1)
+#define unlikely(x)	__builtin_expect(!!(x), 0)
+
+/*
+ * Bit operations and unaligned access
+ */
+#define BITS_PER_LONG	(8 * (int)sizeof(long))
+
+static inline unsigned long __ffs(unsigned long word)
+{
+	return __builtin_ctzl(word);
+}
+
+static inline unsigned long __fls(unsigned long word)
+{
+	return BITS_PER_LONG - 1 - __builtin_clzl(word);
+}
+
+#define get_unaligned(ptr) \
+	(((const struct { __typeof__(*(ptr)) v; } __attribute__((packed)) *)(ptr))->v)
+
+/*
+ * Byte order
+ */
+#define le16_to_cpu(x)	le16toh(x)
+#define cpu_to_le16(x)	htole16(x)
+#define le32_to_cpu(x)	le32toh(x)
+#define cpu_to_le32(x)	htole32(x)
+
+/*
+ * Memory allocation
+ */
+#define PAGE_SIZE	4096UL
+#define PAGE_ALIGN(x)	(((x) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1))
+#define GFP_KERNEL	0
+#define GFP_ATOMIC	1
+
+typedef unsigned int gfp_t;
+
+#define ARRAY_SIZE(a)	(sizeof(a) / sizeof((a)[0]))
+
+static inline void *kzalloc(size_t size, gfp_t flags)
+{
+	return calloc(1, size);
+}
+
+static inline void kfree(const void *p)
+{
+	free((void *)p);
+}
+
+static inline unsigned long get_zeroed_page(gfp_t flags)
+{
+	void *p;
+
+	if (posix_memalign(&p, PAGE_SIZE, PAGE_SIZE))
+		return 0;
+	memset(p, 0, PAGE_SIZE);
+	return (unsigned long)p;
+}
+
+static inline void free_page(unsigned long p)
+{
+	free((void *)p);
+}
+
+static inline void *vmalloc(unsigned long size)
+{
+	return malloc(size);
+}
+
+static inline void *vmalloc_user(unsigned long size)
+{
+	void *p;
+
+	if (posix_memalign(&p, PAGE_SIZE, PAGE_ALIGN(size)))
+		return NULL;
+	memset(p, 0, PAGE_ALIGN(size));
+	return p;
+}
+
+static inline void vfree(const void *p)
+{
+	free((void *)p);
+}
+
+/*
+ * Locking. Nothing runs in interrupt context here,
+ * so the _irqsave variants just take the lock.
+ */
+#define barrier()	__asm__ __volatile__("" ::: "memory")
+#define cpu_relax()	barrier()
+
+typedef struct {
+	int locked;
+} spinlock_t;
+
+#define DEFINE_SPINLOCK(x)	spinlock_t x = { 0 }
+#define spin_lock_init(l)	((l)->locked = 0)
+
+static inline void spin_lock(spinlock_t *l)
+{
+	while (__atomic_exchange_n(&l->locked, 1, __ATOMIC_ACQUIRE))
+		while (__atomic_load_n(&l->locked, __ATOMIC_RELAXED))
+			cpu_relax();
+}
+
+static inline void spin_unlock(spinlock_t *l)
+{
+	__atomic_store_n(&l->locked, 0, __ATOMIC_RELEASE);
+}
+
+#define spin_lock_irqsave(l, flags)	  do { (flags) = 0; spin_lock(l); } while (0)
+#define spin_unlock_irqrestore(l, flags) do { (void)(flags); spin_unlock(l); } while (0)
+
+struct mutex {
+	pthread_mutex_t m;
+};
+
+#define mutex_init(l)			pthread_mutex_init(&(l)->m, NULL)
+#define mutex_lock(l)			pthread_mutex_lock(&(l)->m)
+#define mutex_lock_interruptible(l)	pthread_mutex_lock(&(l)->m)
+#define mutex_unlock(l)			pthread_mutex_unlock(&(l)->m)
+
+/* Readers never block writers here, and nothing is freed under them */
+#define rcu_read_lock()		barrier()
+#define rcu_read_unlock()	barrier()
+
+#define smp_mb()	__sync_synchronize()
+#define smp_rmb()	__atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define smp_wmb()	__atomic_thread_fence(__ATOMIC_RELEASE)
+#define ACCESS_ONCE(x)	(*(volatile __typeof__(x) *)&(x))
+
+/*
+ * Lists and ring indices
+ */
+#define container_of(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+
+struct list_head {
+	struct list_head *next, *prev;
+};
+
+#define LIST_HEAD(name)	struct list_head name = { &(name), &(name) }
+#define INIT_LIST_HEAD(l)	((l)->next = (l)->prev = (l))
+
+static inline void list_add_tail(struct list_head *n, struct list_head *head)
+{
+	n->next = head;
+	n->prev = head->prev;
+	head->prev->next = n;
+	head->prev = n;
+}
+
+static inline void list_del(struct list_head *entry)
+{
+	entry->prev->next = entry->next;
+	entry->next->prev = entry->prev;
+}
+
+#define list_empty(head)	(__atomic_load_n(&(head)->next, __ATOMIC_RELAXED) == (head))
+
+#define list_for_each_entry(pos, head, member) \
+	for (pos = container_of((head)->next, __typeof__(*pos), member); \
+	     &pos->member != (head); \
+	     pos = container_of(pos->member.next, __typeof__(*pos), member))
+
+#define CIRC_CNT(head, tail, size)	(((head) - (tail)) & ((size) - 1))
+#define CIRC_SPACE(head, tail, size)	CIRC_CNT((tail), ((head) + 1), (size))
+
+/*
+ * Radix trees, as a fixed two-level table covering indices below
+ * 2^(2 * LUNIX_SHIM_RADIX_SHIFT). Lookups are lockless, the rest
+ * must be serialized by the caller, as in the kernel.
+ */
+#define LUNIX_SHIM_RADIX_SHIFT	10
+#define LUNIX_SHIM_RADIX_SIZE	(1UL << LUNIX_SHIM_RADIX_SHIFT)
+
+struct radix_tree_root {
+	void **leaf[LUNIX_SHIM_RADIX_SIZE];
+};
+
+#define RADIX_TREE(name, mask)	struct radix_tree_root name = { { NULL } }
+
+static inline void *radix_tree_lookup(struct radix_tree_root *root, unsigned long index)
+{
+	void **leaf;
+
+	if (index >= LUNIX_SHIM_RADIX_SIZE * LUNIX_SHIM_RADIX_SIZE)
+		return NULL;
+	leaf = __atomic_load_n(&root->leaf[index >> LUNIX_SHIM_RADIX_SHIFT], __ATOMIC_ACQUIRE);
+	if (!leaf)
+		return NULL;
+	return __atomic_load_n(&leaf[index & (LUNIX_SHIM_RADIX_SIZE - 1)], __ATOMIC_ACQUIRE);
+}
+
+static inline int radix_tree_insert(struct radix_tree_root *root, unsigned long index, void *item)
+{
+	void ***slot, **leaf;
+
+	if (index >= LUNIX_SHIM_RADIX_SIZE * LUNIX_SHIM_RADIX_SIZE)
+		return -ENOMEM;
+	slot = &root->leaf[index >> LUNIX_SHIM_RADIX_SHIFT];
+	if (!(leaf = *slot)) {
+		if (!(leaf = calloc(LUNIX_SHIM_RADIX_SIZE, sizeof(void *))))
+			return -ENOMEM;
+		__atomic_store_n(slot, leaf, __ATOMIC_RELEASE);
+	}
+	index &= LUNIX_SHIM_RADIX_SIZE - 1;
+	if (leaf[index])
+		return -EEXIST;
+	__atomic_store_n(&leaf[index], item, __ATOMIC_RELEASE);
+	return 0;
+}
+
+static inline void *radix_tree_delete(struct radix_tree_root *root, unsigned long index)
+{
+	void **leaf, *item;
+
+	if (!(item = radix_tree_lookup(root, index)))
+		return NULL;
+	leaf = root->leaf[index >> LUNIX_SHIM_RADIX_SHIFT];
+	leaf[index & (LUNIX_SHIM_RADIX_SIZE - 1)] = NULL;
+	return item;
+}
+
+static inline unsigned int radix_tree_gang_lookup(struct radix_tree_root *root,
+	void **results, unsigned long first_index, unsigned int max_items)
+{
+	unsigned long i;
+	unsigned int n = 0;
+
+	for (i = first_index; n < max_items && i < LUNIX_SHIM_RADIX_SIZE * LUNIX_SHIM_RADIX_SIZE; i++)
+		if ((results[n] = radix_tree_lookup(root, i)))
+			n++;
+	return n;
+}
+
+/*
+ * Wait queues: nobody ever sleeps in userspace,
+ * so just count how many times sleepers would have been woken up.
+ */
+typedef struct {
+	unsigned long wakeups;
+} wait_queue_head_t;
+
+#define init_waitqueue_head(q)		((q)->wakeups = 0)
+#define wake_up_interruptible(q)	__sync_fetch_and_add(&(q)->wakeups, 1)
+
+/*
+ * Time
+ */
+static inline unsigned long get_seconds(void)
+{
+	return (unsigned long)time(NULL);
+}
+
+typedef int64_t ktime_t;
+
+static inline ktime_t ktime_get(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#define ktime_to_ns(kt)	((int64_t)(kt))
+
+#endif	/* _LUNIX_SHIM_H */
@@ -10,15 +10,21 @@
  
 #include <stdio.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "lunix-chrdev.h"
 
 
 int main() {
 	
 	char input[20],output[50],meas[6];
-	float temp;
-	int sensor,count,i;
-	FILE *in,*out;
+	struct lunix_record_struct rec[16];
+	int sensor,count,i,j,n,fd,mode;
+	FILE *out;
 	
 	printf("Choose sensor: ");
 	scanf("%d",&sensor);
@@ -34,13 +40,20 @@ int main() {
 	
 	sprintf(input,"/dev/lunix%d-%s",sensor,meas);
 	
-	in = fopen(input,"r");
+	fd = open(input,O_RDONLY);
 	
-	if (in == NULL) {
+	if (fd < 0) {
 		printf("Error opening sensor file %s: %s.\n",input,strerror(errno));
 		return 1;
 	}
 	
+	/* Values in thousandths, no text to parse and no float rounding */
+	mode = LUNIX_MODE_BINARY;
+	if (ioctl(fd,LUNIX_IOC_SET_MODE,&mode) < 0) {
+		printf("Error switching %s to binary mode: %s.\n",input,strerror(errno));
+		return 1;
+	}
+	
 	out = fopen(output,"w");
 	
 	if (out == NULL) {
@@ -48,12 +61,18 @@ int main() {
 		return 1;
 	}
 	
-	for (i=0;i<count;i++) {
-		fscanf(in,"%f",&temp);
-		fprintf(out,"%.3f\n",temp);
+	for (i=0;i<count;) {
+		n = read(fd,rec,sizeof(rec));
+		if (n <= 0) {
+			printf("Error reading %s: %s.\n",input,n ? strerror(errno) : "end of file");
+			break;
+		}
+		for (j=0;j<n/(int)sizeof(rec[0]) && i<count;j++,i++)
+			fprintf(out,"%s%d.%03d\n",rec[j].value < 0 ? "-" : "",
+				abs(rec[j].value)/1000,abs(rec[j].value)%1000);
 	}
 	
-	fclose(in);
+	close(fd);
 	fclose(out);
 	
 	return 0;